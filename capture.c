@@ -0,0 +1,109 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Records every frame handled by the server into a capture file, see
+ * capture.h for the format. Workers append under a lock, a unit is served by
+ * one worker so its frames are recorded in the order they were processed.
+ * Records are buffered and flushed once a second while traffic flows and on
+ * exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "capture.h"
+#include "simclock.h"
+#include "tesla.h"
+#include "log.h"
+
+#define CAPTURE_BUFFER_SIZE      (1024 * 1024)
+#define CAPTURE_FLUSH_INTERVAL   SIMCLOCK_NS_PER_SEC
+
+// Private data
+static FILE* fp = NULL;
+static uint64_t origin;
+static uint64_t last_flush;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * SIMCLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+int capture_open(const char* path, int unit_count, int shards, uint64_t tick, uint16_t telemetry)
+{
+    capture_header_t header;
+
+    fp = fopen(path, "wb");
+    if ( fp == NULL )
+    {
+        log_error("%s - cannot create %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    memset(&header, 0, sizeof (header));
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.unit_count = unit_count;
+    header.started = clock_ns(CLOCK_REALTIME);
+    header.tick_us = tick / 1000;
+    header.shards = shards;
+    header.telemetry = telemetry;
+    fwrite(&header, sizeof (header), 1, fp);
+
+    origin = clock_ns(CLOCK_MONOTONIC);
+    last_flush = origin;
+    atexit(capture_close);
+
+    log_info("%s - capturing traffic to %s\n", __PRETTY_FUNCTION__, path);
+    return 0;
+}
+
+void capture_frame(int session, const uint8_t* query, int query_length, const uint8_t* reply, int reply_length)
+{
+    capture_record_t record;
+    uint64_t now;
+
+    if ( fp == NULL )
+    {
+        return;
+    }
+
+    now = clock_ns(CLOCK_MONOTONIC);
+    record.time = now - origin;
+    record.sim_time = simclock_now();
+    record.session = session;
+    record.tick = query_tick;
+    record.query_length = query_length;
+    record.reply_length = reply_length;
+    memset(record.reserved, 0, sizeof (record.reserved));
+
+    pthread_mutex_lock(&lock);
+    fwrite(&record, sizeof (record), 1, fp);
+    fwrite(query, query_length, 1, fp);
+    fwrite(reply, reply_length, 1, fp);
+    if ( now - last_flush >= CAPTURE_FLUSH_INTERVAL )
+    {
+        fflush(fp);
+        last_flush = now;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void capture_close(void)
+{
+    pthread_mutex_lock(&lock);
+    if ( fp != NULL )
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
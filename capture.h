@@ -0,0 +1,48 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Capture file of the modbus traffic handled by the simulator. A header is
+ * followed by one record per frame, each record holds the query exactly as
+ * received and the reply that was sent, see mbreplay for the reader. The
+ * simulation tick each frame saw lets a replay put ticks between the same
+ * frames, whether the capture was taken in real time or stepped.
+ */
+#ifndef CAPTURE_DOT_H
+#define CAPTURE_DOT_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC            0x50414354          // "TCAP"
+#define CAPTURE_VERSION          2                   // 1 had no tick count, replayed by sim_time
+
+typedef struct capture_header_struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t unit_count;                             // units simulated while capturing
+    uint64_t started;                                // CLOCK_REALTIME ns at start
+    uint32_t tick_us;                                // simulation tick, 0 in captures of 1s ticks
+    uint16_t shards;                                 // workers serving the units, 0 in captures of 1
+    uint16_t telemetry;                              // telemetry block address, 0 without one
+    uint8_t  reserved[8];
+}capture_header_t;
+
+typedef struct capture_record_struct
+{
+    uint64_t time;                                   // monotonic ns since capture start
+    uint64_t sim_time;                               // simulation clock when processed
+    uint32_t session;                                // connection the frame came in on
+    uint32_t tick;                                   // simulation tick the query saw, query_tick
+    uint16_t query_length;                           // query bytes follow the record
+    uint16_t reply_length;                           // then reply bytes
+    uint8_t  reserved[4];
+}capture_record_t;
+
+_Static_assert(sizeof (capture_header_t) == 32, "capture header layout changed");
+_Static_assert(sizeof (capture_record_t) == 32, "capture record layout changed");
+
+int  capture_open(const char* path, int unit_count, int shards, uint64_t tick, uint16_t telemetry);
+void capture_frame(int session, const uint8_t* query, int query_length, const uint8_t* reply, int reply_length);
+void capture_close(void);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Checkpoints of the simulator state, see checkpoint.h for the file layout.
+ * Every worker writes the units of its own shard into the slot, the last
+ * shard to finish commits it, so no worker waits on another. The file is
+ * shared mapped, the page cache keeps every committed checkpoint when the
+ * process crashes and msync schedules write back without waiting for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "log.h"
+
+#define CHECKPOINT_NS_PER_MS        1000000ULL
+
+// Private data
+static checkpoint_header_t* header = NULL;
+static size_t slot_size;
+static int slot = 0;                                // slot being written by checkpoint_begin
+static uint64_t generation = 0;                     // latest committed generation
+static checkpoint_unit_t* restored = NULL;          // copy of the checkpoint found at start
+static int restored_count = 0;
+static uint64_t interval_ns;
+static uint64_t next_due;
+static int shards = 1;
+static uint32_t joined = 0;                         // shards done with the slot being written
+static uint32_t round = 0;                          // checkpoints committed since start
+static uint32_t* shard_round = NULL;                // round each shard writes next
+
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t checksum(const uint8_t* p, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for ( i = 0; i < length; i++ )
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint8_t* slot_data(checkpoint_header_t* h, size_t size, int index)
+{
+    return (uint8_t*)(h + 1) + index * size;
+}
+
+//
+// Keep a copy of the newest complete checkpoint in the file, the file layout
+// may be changed before it is restored
+//
+static void checkpoint_load(checkpoint_header_t* h, off_t file_size)
+{
+    size_t size;
+    int i, best = -1;
+
+    if ( h->magic != CHECKPOINT_MAGIC || h->version != CHECKPOINT_VERSION ||
+         h->record_size != sizeof (checkpoint_unit_t) || h->unit_count == 0 )
+    {
+        return;
+    }
+    size = h->unit_count * sizeof (checkpoint_unit_t);
+    if ( (off_t)(sizeof (checkpoint_header_t) + 2 * size) > file_size )
+    {
+        return;
+    }
+
+    for ( i = 0; i < 2; i++ )
+    {
+        if ( h->generation[i] == 0 || checksum(slot_data(h, size, i), size) != h->checksum[i] )
+        {
+            continue;
+        }
+        if ( best == -1 || h->generation[i] > h->generation[best] )
+        {
+            best = i;
+        }
+    }
+    if ( best == -1 )
+    {
+        log_warn("%s - no complete checkpoint found\n", __PRETTY_FUNCTION__);
+        return;
+    }
+
+    restored = malloc(size);
+    if ( restored == NULL )
+    {
+        return;
+    }
+    memcpy(restored, slot_data(h, size, best), size);
+    restored_count = h->unit_count;
+    generation = h->generation[best];
+    slot = best ^ 1;
+}
+
+//
+// Map the checkpoint file, creating it if needed. A valid checkpoint already
+// in the file is kept for checkpoint_restore. An interval of 0 only restores.
+// Every one of shard_count shards takes part in each checkpoint.
+//
+int checkpoint_init(const char* path, int unit_count, int shard_count, int interval)
+{
+    size_t file_size;
+    struct stat st;
+    void* p;
+    int fd;
+
+    slot_size = unit_count * sizeof (checkpoint_unit_t);
+    file_size = sizeof (checkpoint_header_t) + 2 * slot_size;
+    shards = shard_count;
+    shard_round = calloc(shards, sizeof (uint32_t));
+    if ( shard_round == NULL )
+    {
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd == -1 || fstat(fd, &st) == -1 )
+    {
+        log_warn("%s - cannot open %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        if ( fd != -1 )
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if ( st.st_size >= (off_t)sizeof (checkpoint_header_t) )
+    {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( p != MAP_FAILED )
+        {
+            checkpoint_load(p, st.st_size);
+            munmap(p, st.st_size);
+        }
+    }
+
+    if ( ftruncate(fd, file_size) == -1 )
+    {
+        log_warn("%s - cannot size %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( p == MAP_FAILED )
+    {
+        log_warn("%s - mmap %s failed: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        return -1;
+    }
+    header = p;
+
+    if ( restored_count != unit_count )
+    {
+        // new file or a different number of units, the old slots are no longer valid
+        memset(header, 0, sizeof (checkpoint_header_t));
+        header->magic = CHECKPOINT_MAGIC;
+        header->version = CHECKPOINT_VERSION;
+        header->unit_count = unit_count;
+        header->record_size = sizeof (checkpoint_unit_t);
+        slot = 0;
+    }
+
+    interval_ns = (uint64_t)interval * 1000000000ULL;
+    next_due = monotonic_ns() + interval_ns;
+    log_info("%s - checkpoint %s every %d seconds\n", __PRETTY_FUNCTION__, path, interval);
+
+    return 0;
+}
+
+//
+// Units of the checkpoint found at start, NULL if there was none
+//
+const checkpoint_unit_t* checkpoint_restore(int* count)
+{
+    *count = restored_count;
+    return restored;
+}
+
+//
+// True once the shard has written its part of the checkpoint being taken
+//
+static bool checkpoint_written(int shard)
+{
+    return shard_round[shard] != __atomic_load_n(&round, __ATOMIC_ACQUIRE);
+}
+
+bool checkpoint_due(int shard)
+{
+    return header != NULL && interval_ns != 0 && !checkpoint_written(shard) &&
+           monotonic_ns() >= __atomic_load_n(&next_due, __ATOMIC_RELAXED);
+}
+
+//
+// Milliseconds until the shard has a checkpoint to write, -1 if never. Suits
+// epoll_wait. A shard that has written its part waits for the next interval,
+// the checkpoint is due again no sooner than that after the commit.
+//
+int checkpoint_timeout(int shard)
+{
+    uint64_t now, due;
+
+    if ( header == NULL || interval_ns == 0 )
+    {
+        return -1;
+    }
+    if ( checkpoint_written(shard) )
+    {
+        return interval_ns / CHECKPOINT_NS_PER_MS;
+    }
+    now = monotonic_ns();
+    due = __atomic_load_n(&next_due, __ATOMIC_RELAXED);
+    if ( now >= due )
+    {
+        return 0;
+    }
+    return (due - now + CHECKPOINT_NS_PER_MS - 1) / CHECKPOINT_NS_PER_MS;
+}
+
+//
+// Slot for the shard to fill with its units, invalidated until the checkpoint
+// is committed. NULL if the shard has written its part already.
+//
+checkpoint_unit_t* checkpoint_begin(int shard)
+{
+    if ( header == NULL || checkpoint_written(shard) )
+    {
+        return NULL;
+    }
+    __atomic_store_n(&header->generation[slot], 0, __ATOMIC_RELEASE);
+    return (checkpoint_unit_t*)slot_data(header, slot_size, slot);
+}
+
+//
+// The last shard to finish commits the slot and starts the next round
+//
+void checkpoint_commit(int shard)
+{
+    uint8_t* data = slot_data(header, slot_size, slot);
+
+    shard_round[shard]++;
+    if ( __atomic_add_fetch(&joined, 1, __ATOMIC_ACQ_REL) != (uint32_t)shards )
+    {
+        return;
+    }
+
+    header->checksum[slot] = checksum(data, slot_size);
+    __atomic_store_n(&header->generation[slot], ++generation, __ATOMIC_RELEASE);
+    msync(header, sizeof (checkpoint_header_t) + 2 * slot_size, MS_ASYNC);
+
+    slot ^= 1;
+    joined = 0;
+    __atomic_store_n(&next_due, monotonic_ns() + interval_ns, __ATOMIC_RELAXED);
+
+    free(restored);                                 // warm start is over
+    restored = NULL;
+    restored_count = 0;
+    __atomic_store_n(&round, round + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Crash safe checkpoints of the simulator state in a memory mapped file. The
+ * file holds a header and two slots of unit records. A checkpoint is written
+ * into the slot not holding the latest one and committed by publishing its
+ * generation and checksum in the header, so a crash at any point leaves at
+ * least one complete checkpoint to warm start from.
+ */
+#ifndef CHECKPOINT_DOT_H
+#define CHECKPOINT_DOT_H
+
+#include <stdint.h>
+#include "tesla.h"
+#include "typedefs.h"
+
+#define CHECKPOINT_MAGIC            0x4B43534C      // "LSCK"
+#define CHECKPOINT_VERSION          3
+#define CHECKPOINT_INTERVAL_DEFAULT 10              // seconds
+#define CHECKPOINT_NAME_FORMAT      "tesla.%d.state" // default file, by listen port
+
+typedef struct checkpoint_header_struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t unit_count;
+    uint32_t record_size;
+    uint32_t checksum[2];                           // FNV-1a of each slot
+    uint64_t generation[2];                         // 0 while a slot is empty or being written
+    uint8_t  reserved[24];
+}checkpoint_header_t;
+
+typedef struct checkpoint_unit_struct
+{
+    uint8_t  unit_id;
+    uint16_t heartbeat_previous;
+    uint32_t direct_power;
+    uint32_t memory;
+    battery_t battery;
+    uint16_t registers[UT_REGISTERS_NB];            // register image
+}checkpoint_unit_t;
+
+_Static_assert(sizeof (checkpoint_header_t) == 64, "checkpoint header layout changed");
+
+int  checkpoint_init(const char* path, int unit_count, int shards, int interval);
+const checkpoint_unit_t* checkpoint_restore(int* count);
+bool checkpoint_due(int shard);
+int  checkpoint_timeout(int shard);
+checkpoint_unit_t* checkpoint_begin(int shard);
+void checkpoint_commit(int shard);
+
+#endif
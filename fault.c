@@ -0,0 +1,260 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Fault injection, see fault.h. A fault profile is a text file of rules, a
+ * target followed by "key=value" settings:
+ *
+ *   *             delay=20 jitter=10           # every request, 20 to 30 ms late
+ *   fc16          drop=5                       # 5% of FC16 requests never answered
+ *   1020-1021     delay=500 exception=6:10     # set point writes slow, 10% busy
+ *
+ *   delay       ms the reply is held back
+ *   jitter      up to this many ms added to the delay, uniform
+ *   drop        percent of requests left unanswered
+ *   exception   code[:percent], exception forced instead of the reply (100%)
+ *
+ * A register target, one register or a range, matches requests whose first
+ * register addressed falls in it: the read address of FC3, the write address
+ * of FC6, FC16 and FC23. Register rules win over function code rules, which
+ * win over *. A later rule for the same target replaces an earlier one.
+ * Held back replies are sent by the server from its timer wheel, they never
+ * stall other clients or the simulation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fault.h"
+#include "tesla.h"
+#include "log.h"
+
+#define FAULT_LINE_LENGTH        256
+#define FAULT_CHANCE_SCALE       4294967296.0        // chances are out of 2^32
+
+// Private data
+static fault_rule_t rules[FAULT_RULES_MAX];
+static int rule_count = 0;
+static const fault_rule_t* by_register[UT_REGISTERS_NB];
+static const fault_rule_t* by_fc[FAULT_FUNCTION_CODES];
+static const fault_rule_t* any = NULL;
+
+bool fault_enabled = false;
+__thread uint32_t fault_delay = 0;
+
+
+//
+// Next number of the unit's random sequence, xorshift32
+//
+static uint32_t fault_random(unit_t* unit)
+{
+    uint32_t x = unit->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    unit->random = x;
+    return x;
+}
+
+static int fault_percent(const char* text, uint64_t* chance)
+{
+    char* end;
+    double percent = strtod(text, &end);
+
+    if ( end == text || *end != '\0' || !(percent >= 0.0 && percent <= 100.0) )
+    {
+        return -1;
+    }
+    *chance = (uint64_t)(percent / 100.0 * FAULT_CHANCE_SCALE);
+    return 0;
+}
+
+//
+// Settings of one rule, "key=value" tokens
+//
+static int fault_parse(fault_rule_t* rule, char* text)
+{
+    char *token, *value, *end, *save = NULL;
+    unsigned long number;
+
+    memset(rule, 0, sizeof (*rule));
+    for ( token = strtok_r(text, " \t", &save); token != NULL; token = strtok_r(NULL, " \t", &save) )
+    {
+        value = strchr(token, '=');
+        if ( value == NULL )
+        {
+            return -1;
+        }
+        *value++ = '\0';
+
+        if ( strcmp(token, "drop") == 0 )
+        {
+            if ( fault_percent(value, &rule->drop) == -1 )
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        number = strtoul(value, &end, 10);
+        if ( end == value )
+        {
+            return -1;
+        }
+        if ( strcmp(token, "delay") == 0 && *end == '\0' && number <= FAULT_DELAY_MAX_MS )
+        {
+            rule->delay = number;
+        }
+        else if ( strcmp(token, "jitter") == 0 && *end == '\0' && number <= FAULT_DELAY_MAX_MS )
+        {
+            rule->jitter = number;
+        }
+        else if ( strcmp(token, "exception") == 0 && number >= 1 && number <= 0x0B )
+        {
+            rule->exception = number;
+            rule->exception_rate = (uint64_t)FAULT_CHANCE_SCALE;
+            if ( *end == ':' && fault_percent(end + 1, &rule->exception_rate) == -1 )
+            {
+                return -1;
+            }
+            if ( *end != ':' && *end != '\0' )
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Point the lookup tables of a target at its rule, * , fcN, N or N-M
+//
+static int fault_target(const char* target, const fault_rule_t* rule)
+{
+    unsigned long first, last;
+    char* end;
+
+    if ( strcmp(target, "*") == 0 )
+    {
+        any = rule;
+        return 0;
+    }
+    if ( strncmp(target, "fc", 2) == 0 )
+    {
+        first = strtoul(target + 2, &end, 10);
+        if ( end == target + 2 || *end != '\0' || first >= FAULT_FUNCTION_CODES )
+        {
+            return -1;
+        }
+        by_fc[first] = rule;
+        return 0;
+    }
+
+    first = last = strtoul(target, &end, 10);
+    if ( end == target )
+    {
+        return -1;
+    }
+    if ( *end == '-' )
+    {
+        target = end + 1;
+        last = strtoul(target, &end, 10);
+        if ( end == target )
+        {
+            return -1;
+        }
+    }
+    if ( *end != '\0' || last < first || last >= UT_REGISTERS_NB )
+    {
+        return -1;
+    }
+    for ( ; first <= last; first++ )
+    {
+        by_register[first] = rule;
+    }
+    return 0;
+}
+
+//
+// Load a fault profile, called once before the server starts
+//
+int fault_init(const char* path)
+{
+    char line[FAULT_LINE_LENGTH];
+    char *target, *settings, *p;
+    FILE* fp;
+    int number = 0, retval = 0;
+
+    fp = fopen(path, "r");
+    if ( fp == NULL )
+    {
+        log_error("%s - cannot open %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        return -1;
+    }
+
+    while ( retval == 0 && fgets(line, sizeof (line), fp) != NULL )
+    {
+        number++;
+        if ( (p = strchr(line, '#')) != NULL || (p = strchr(line, '\n')) != NULL )
+        {
+            *p = '\0';
+        }
+        target = strtok_r(line, " \t", &settings);
+        if ( target == NULL )
+        {
+            continue;                                        // blank or comment
+        }
+
+        if ( rule_count == FAULT_RULES_MAX || fault_parse(&rules[rule_count], settings) == -1 ||
+             fault_target(target, &rules[rule_count]) == -1 )
+        {
+            log_error("%s - %s:%d: bad rule for %s\n", __PRETTY_FUNCTION__, path, number, target);
+            retval = -1;
+            break;
+        }
+        rule_count++;
+    }
+    fclose(fp);
+
+    if ( retval == 0 )
+    {
+        fault_enabled = rule_count != 0;
+        log_info("%s - %d fault rules from %s\n", __PRETTY_FUNCTION__, rule_count, path);
+    }
+    return retval;
+}
+
+//
+// Fault of one request. Returns the action and for FAULT_EXCEPTION the code
+// in exception, a delay for the reply is left in fault_delay.
+//
+int fault_check(unit_t* unit, uint8_t fc, uint16_t address, int* exception)
+{
+    const fault_rule_t* rule = ( address < UT_REGISTERS_NB ) ? by_register[address] : NULL;
+
+    if ( rule == NULL )
+    {
+        rule = ( fc < FAULT_FUNCTION_CODES && by_fc[fc] != NULL ) ? by_fc[fc] : any;
+        if ( rule == NULL )
+        {
+            return FAULT_NONE;
+        }
+    }
+
+    if ( rule->drop && fault_random(unit) < rule->drop )
+    {
+        return FAULT_DROP;
+    }
+    fault_delay = rule->delay + ( rule->jitter ? fault_random(unit) % (rule->jitter + 1) : 0 );
+    if ( rule->exception && fault_random(unit) < rule->exception_rate )
+    {
+        *exception = rule->exception;
+        return FAULT_EXCEPTION;
+    }
+    return FAULT_NONE;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Fault injection, makes the simulated batteries answer like slow or flaky
+ * inverters. A fault profile holds rules per register, per function code or
+ * for every request, a rule delays, jitters, drops or fails replies. The
+ * decisions are drawn from a random sequence of each unit, a capture replays
+ * with the same faults given the same profile.
+ */
+#ifndef FAULT_DOT_H
+#define FAULT_DOT_H
+
+#include <stdint.h>
+#include "typedefs.h"
+
+#define FAULT_RULES_MAX          64
+#define FAULT_FUNCTION_CODES     128
+#define FAULT_DELAY_MAX_MS       3600000             // one hour
+
+typedef enum
+{
+    FAULT_NONE = 0,                                  // reply as usual, maybe after fault_delay
+    FAULT_DROP,                                      // no reply at all
+    FAULT_EXCEPTION                                  // reply with the exception code given
+}fault_action_t;
+
+typedef struct fault_rule_struct
+{
+    uint32_t delay;                                  // ms the reply is held back
+    uint32_t jitter;                                 // up to this many ms more, uniform
+    uint64_t drop;                                   // chance out of 2^32
+    uint64_t exception_rate;                         // chance out of 2^32
+    uint8_t  exception;                              // code forced, 0 for none
+}fault_rule_t;
+
+extern bool fault_enabled;                           // a profile is loaded
+extern __thread uint32_t fault_delay;                // ms to hold back the reply of the last query, 0 sends it at once
+
+int fault_init(const char* path);
+int fault_check(unit_t* unit, uint8_t fc, uint16_t address, int* exception);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Copy on write register images, see image.h. Private pages are never given
+ * back, a register once written stays in the image until the process exits.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "tesla.h"
+#include "log.h"
+
+_Static_assert(UT_REGISTERS_NB <= IMAGE_REGISTERS, "register image does not fit its pages");
+_Static_assert(IMAGE_PAGES == 32, "one shared bit per page");
+
+// Private data
+static uint16_t template[IMAGE_REGISTERS] __attribute__((aligned(64)));
+
+
+//
+// New image of a unit, every page shared with the template
+//
+void image_init(image_t* image)
+{
+    int i;
+
+    for ( i = 0; i < IMAGE_PAGES; i++ )
+    {
+        image->page[i] = template + i * IMAGE_PAGE_REGISTERS;
+    }
+    image->shared = 0xFFFFFFFFu;
+}
+
+//
+// Image whose writes go straight into the template, to fill in the values
+// every unit starts with. Only before any unit image is in use.
+//
+void image_prototype(image_t* image)
+{
+    image_init(image);
+    image->shared = 0;
+}
+
+//
+// Give the unit its own copy of a shared page
+//
+uint16_t* image_copy(image_t* image, int page)
+{
+    uint16_t* registers;
+
+    if ( posix_memalign((void**)&registers, 64, IMAGE_PAGE_REGISTERS * sizeof (uint16_t)) != 0 )
+    {
+        log_error("%s - out of memory\n", __PRETTY_FUNCTION__);
+        return NULL;
+    }
+    memcpy(registers, image->page[page], IMAGE_PAGE_REGISTERS * sizeof (uint16_t));
+    image->page[page] = registers;
+    image->shared &= ~(1u << page);
+    return registers;
+}
+
+//
+// Flatten the first count registers into a plain array
+//
+void image_save(const image_t* image, uint16_t* registers, int count)
+{
+    int i, n;
+
+    for ( i = 0; i < count; i += n )
+    {
+        n = image_span(i, count - i);
+        memcpy(registers + i, image_readable(image, i), n * sizeof (uint16_t));
+    }
+}
+
+//
+// Store a run of registers, a run over a shared page that leaves it as it
+// is copies nothing. Returns -1 if a page copy fails.
+//
+int image_store(image_t* image, uint16_t address, const uint16_t* registers, int count)
+{
+    uint16_t* dst;
+    int i, n;
+
+    for ( i = 0; i < count; i += n )
+    {
+        n = image_span(address + i, count - i);
+        if ( ((image->shared >> ((address + i) >> IMAGE_PAGE_BITS)) & 1) &&
+             memcmp(image_readable(image, address + i), registers + i, n * sizeof (uint16_t)) == 0 )
+        {
+            continue;
+        }
+        dst = image_writable(image, address + i);
+        if ( dst == NULL )
+        {
+            return -1;
+        }
+        memcpy(dst, registers + i, n * sizeof (uint16_t));
+    }
+    return 0;
+}
+
+//
+// Pages the image has copied for itself
+//
+int image_private(const image_t* image)
+{
+    return __builtin_popcount(~image->shared);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Copy on write register images. A unit's image is a table of pages which
+ * all start out pointing into one read only template shared by every unit,
+ * a page is copied for the unit only when a write changes one of its
+ * registers. An idle unit costs its page table, each page it has written
+ * IMAGE_PAGE_REGISTERS registers more. An image belongs to the worker of its
+ * unit, the template is filled in once before the workers start.
+ */
+#ifndef IMAGE_DOT_H
+#define IMAGE_DOT_H
+
+#include <stdint.h>
+
+#define IMAGE_REGISTERS          0x0800              // register image size, UT_REGISTERS_NB fits
+#define IMAGE_PAGE_BITS          6
+#define IMAGE_PAGE_REGISTERS     (1 << IMAGE_PAGE_BITS)   // 128 bytes
+#define IMAGE_PAGE_MASK          (IMAGE_PAGE_REGISTERS - 1)
+#define IMAGE_PAGES              (IMAGE_REGISTERS / IMAGE_PAGE_REGISTERS)
+
+typedef struct image_struct
+{
+    uint32_t shared;                                 // bit per page still pointing at the template
+    uint16_t* page[IMAGE_PAGES];
+}image_t;
+
+void image_init(image_t* image);
+void image_prototype(image_t* image);
+uint16_t* image_copy(image_t* image, int page);
+void image_save(const image_t* image, uint16_t* registers, int count);
+int  image_store(image_t* image, uint16_t address, const uint16_t* registers, int count);
+int  image_private(const image_t* image);
+
+static inline uint16_t image_get(const image_t* image, uint16_t address)
+{
+    return image->page[address >> IMAGE_PAGE_BITS][address & IMAGE_PAGE_MASK];
+}
+
+//
+// Registers from address to the end of its page, at most count
+//
+static inline int image_span(uint16_t address, int count)
+{
+    int span = IMAGE_PAGE_REGISTERS - (address & IMAGE_PAGE_MASK);
+
+    return ( span < count ) ? span : count;
+}
+
+//
+// Registers from address on for reading, valid up to the end of the page
+//
+static inline const uint16_t* image_readable(const image_t* image, uint16_t address)
+{
+    return image->page[address >> IMAGE_PAGE_BITS] + (address & IMAGE_PAGE_MASK);
+}
+
+//
+// Registers from address on for writing, valid up to the end of the page. The
+// page is copied first if it is still shared, NULL if that fails.
+//
+static inline uint16_t* image_writable(image_t* image, uint16_t address)
+{
+    int page = address >> IMAGE_PAGE_BITS;
+    uint16_t* registers = image->page[page];
+
+    if ( (image->shared >> page) & 1 )
+    {
+        registers = image_copy(image, page);
+        if ( registers == NULL )
+        {
+            return NULL;
+        }
+    }
+    return registers + (address & IMAGE_PAGE_MASK);
+}
+
+//
+// Store one register. Storing the value already there is free, a shared page
+// is only copied when the value changes. Returns -1 if the copy fails.
+//
+static inline int image_set(image_t* image, uint16_t address, uint16_t value)
+{
+    uint16_t* registers;
+
+    if ( image_get(image, address) == value )
+    {
+        return 0;
+    }
+    registers = image_writable(image, address);
+    if ( registers == NULL )
+    {
+        return -1;
+    }
+    *registers = value;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Asynchronous leveled logger. Messages are formatted by the calling thread
+ * straight into a slot of a bounded lock-free ring and written to stdout in
+ * batches by a background thread, so no request path ever blocks on stdout.
+ * When the ring is full the message is dropped and counted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_RING_SIZE          1024                  // slots, power of two
+#define LOG_MESSAGE_SIZE       248                   // bytes of text per slot
+#define LOG_BATCH_SIZE         (64 * 1024)           // bytes written per write()
+#define LOG_IDLE_SLEEP_NS      5000000               // writer poll period when idle
+
+typedef struct log_slot_struct
+{
+    uint32_t sequence;                               // ring position the slot is ready for
+    uint16_t length;
+    uint8_t  level;
+    char     text[LOG_MESSAGE_SIZE];
+}log_slot_t;
+
+int log_level = LOG_LEVEL_DEFAULT;
+
+// Private data
+static log_slot_t ring[LOG_RING_SIZE];
+static uint32_t head __attribute__((aligned(64)));  // next position claimed by a producer
+static uint32_t tail __attribute__((aligned(64)));  // next position read by the writer
+static uint8_t draining;
+static uint64_t dropped;
+static int started;
+
+static void log_shutdown(void)
+{
+    log_flush();
+}
+
+void log_set_level(int level)
+{
+    if ( level < LOG_LEVEL_ERROR )
+    {
+        level = LOG_LEVEL_ERROR;
+    }
+    else if ( level > LOG_LEVEL_TRACE )
+    {
+        level = LOG_LEVEL_TRACE;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+uint64_t log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+//
+// Claim a slot (multi producer), format into it and publish it
+//
+void log_write(log_level_t level, const char* format, ...)
+{
+    log_slot_t* slot;
+    uint32_t pos, sequence;
+    int32_t diff;
+    va_list ap;
+    int n;
+
+    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(sequence - pos);
+        if ( diff == 0 )
+        {
+            if ( __atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+            {
+                break;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);     // ring full
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(ap, format);
+    n = vsnprintf(slot->text, sizeof (slot->text), format, ap);
+    va_end(ap);
+    if ( n < 0 )
+    {
+        n = 0;
+    }
+    else if ( n >= (int)sizeof (slot->text) )
+    {
+        n = sizeof (slot->text) - 1;
+        slot->text[n - 1] = '\n';                    // keep truncated lines terminated
+    }
+    slot->length = n;
+    slot->level = level;
+
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void log_output(const char* buffer, size_t length)
+{
+    ssize_t rc;
+
+    while ( length > 0 )
+    {
+        rc = write(STDOUT_FILENO, buffer, length);
+        if ( rc == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+        buffer += rc;
+        length -= rc;
+    }
+}
+
+//
+// Copy every published message into one buffer and write it out. Only one
+// thread drains at a time. Returns the number of messages written.
+//
+static int log_drain(void)
+{
+    static char batch[LOG_BATCH_SIZE];
+    log_slot_t* slot;
+    size_t length = 0;
+    int count = 0;
+
+    if ( __atomic_test_and_set(&draining, __ATOMIC_ACQUIRE) )
+    {
+        return 0;
+    }
+
+    for (;;)
+    {
+        slot = &ring[tail & (LOG_RING_SIZE - 1)];
+        if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != tail + 1 )
+        {
+            break;
+        }
+
+        if ( length + slot->length > sizeof (batch) )
+        {
+            log_output(batch, length);
+            length = 0;
+        }
+        memcpy(batch + length, slot->text, slot->length);
+        length += slot->length;
+
+        __atomic_store_n(&slot->sequence, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+    log_output(batch, length);
+
+    __atomic_clear(&draining, __ATOMIC_RELEASE);
+    return count;
+}
+
+//
+// Write out everything logged so far, waiting for a concurrent drain to finish
+//
+void log_flush(void)
+{
+    do
+    {
+        log_drain();
+    } while ( __atomic_load_n(&draining, __ATOMIC_ACQUIRE) ||
+              __atomic_load_n(&tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&head, __ATOMIC_ACQUIRE) );
+}
+
+static void *log_thread(void *ptr)
+{
+    const struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+    uint64_t reported = 0, lost;
+
+    for (;;)
+    {
+        if ( log_drain() == 0 )
+        {
+            nanosleep(&idle, NULL);
+        }
+
+        lost = log_dropped();
+        if ( lost != reported )
+        {
+            log_warn("%s - %llu log messages dropped\n", __PRETTY_FUNCTION__, (unsigned long long)(lost - reported));
+            reported = lost;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Prepare the ring and start the writer thread, called before anything is logged
+//
+int log_init(void)
+{
+    pthread_t thread;
+    uint32_t i;
+
+    if ( started )
+    {
+        return 0;
+    }
+
+    for ( i = 0; i < LOG_RING_SIZE; i++ )
+    {
+        ring[i].sequence = i;
+    }
+
+    if ( pthread_create(&thread, NULL, log_thread, NULL) != 0 )
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(log_shutdown);
+    started = 1;
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the asynchronous leveled logger
+ */
+#ifndef LOG_DOT_H
+#define LOG_DOT_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE
+}log_level_t;
+
+#define LOG_LEVEL_DEFAULT      LOG_LEVEL_INFO
+
+extern int log_level;
+
+//
+// The level test is a single relaxed load, arguments of a disabled message are
+// never evaluated or formatted.
+//
+#define log_enabled(level)     ((int)(level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+#define log_print(level, ...)  do { if ( log_enabled(level) ) log_write(level, __VA_ARGS__); } while (0)
+
+#define log_error(...)         log_print(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)          log_print(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define log_info(...)          log_print(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define log_debug(...)         log_print(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...)         log_print(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+int  log_init(void);
+void log_set_level(int level);
+void log_write(log_level_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+uint64_t log_dropped(void);
+
+#endif
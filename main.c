@@ -13,13 +13,21 @@
 #include <getopt.h>
 #include <sys/socket.h>
 #include "tesla.h"
+#include "server.h"
+#include "log.h"
+#include "simclock.h"
+#include "status.h"
+#include "checkpoint.h"
+#include "capture.h"
+#include "model.h"
+#include "stats.h"
+#include "fault.h"
+#include "trace.h"
 #include <pthread.h>
+#include <signal.h>
 
 #include "typedefs.h"
 
-const uint16_t UT_REGISTERS_NB = 0x07FF;
-static char query[MODBUS_TCP_MAX_ADU_LENGTH];
-
 #define MODBUS_DEFAULT_PORT 1502
 
 
@@ -28,103 +36,358 @@ static void usage(const char *app_name)
     printf("Usage:\n");
     printf("%s [option <value>] ...\n", app_name);
     printf("\nOptions:\n");
-    printf(" -p \t\t # Set Modbus port to listen on for incoming requests (Default 1502)\n");
+    printf(" -p \t\t # Set Modbus port to listen on, port[:workers[:cpus]] (Default 1502, 1 worker)\n");
+    printf("    \t\t # workers share the port and the batteries, up to %d, cpus pins them as 0,2,4-7\n", SERVER_WORKERS_MAX);
+    printf(" -m \t\t # Set maximum number of simultaneous client connections (Default %d)\n", SERVER_MAX_CONNECTIONS_DEFAULT);
+    printf(" -u \t\t # Serve Modbus/UDP on the port instead of TCP, one frame per datagram\n");
+    printf(" -n \t\t # Set number of simulated batteries, addressed by unit id 1..n (Default 1, max %d)\n", UNITS_MAX);
+    printf(" -d \t\t # Set log level, 0 info, 1 debug, 2 trace. Also set through enableDebug register (Default 0)\n");
+    printf(" -x \t\t # Run the simulation faster than real time by this factor (Default 1)\n");
+    printf(" -s \t\t # Stepped simulation, time only advances on writes to simulationStep register (%d)\n", simulationStep);
+    printf(" -r \t\t # Simulation tick in ms, 1 to %d (Default %d)\n", SIMULATION_TICK_MS_MAX, SIMULATION_TICK_MS_DEFAULT);
+    printf(" -c \t\t # Checkpoint file to resume from and save to (Default " CHECKPOINT_NAME_FORMAT ", none when stepped)\n", MODBUS_DEFAULT_PORT);
+    printf(" -k \t\t # Seconds between checkpoints, 0 only resumes (Default %d)\n", CHECKPOINT_INTERVAL_DEFAULT);
+    printf(" -t \t\t # Capture all modbus traffic to this file, replay it with mbreplay\n");
+    printf(" -b \t\t # Battery profile with power limits, efficiency and ramp rate (Default linear model)\n");
+    printf(" -e \t\t # Serve Prometheus metrics on 127.0.0.1 at this port, also in registers %d..%d\n",
+           perfCounters, perfCounters + STATS_REGISTERS - 1);
+    printf(" -a \t\t # Address of the %d register telemetry block, 0 leaves it out (Default %d)\n",
+           TELEMETRY_REGISTERS, telemetryBlock);
+    printf(" -f \t\t # Fault profile delaying, dropping or failing replies, see fault.c for the format\n");
+    printf(" -g \t\t # Trace request stages, written as Chrome trace JSON to this file on SIGUSR1 and at exit\n");
     printf(" -? \t\t # Print this help menu\n");
     printf("\nExamples:\n");
     printf("%s -p 1502  \t # Change the listen port to 1502\n", app_name);
+    printf("%s -p 502:4:0-3 \t # Four workers on port 502, pinned to cpus 0 to 3\n", app_name);
+    printf("%s -u -n 32 \t # Controllers polling 32 batteries over UDP\n", app_name);
+    printf("%s -m 1000  \t # Accept up to 1000 clients at the same time\n", app_name);
+    printf("%s -n 247   \t # Simulate 247 batteries behind the one port\n", app_name);
+    printf("%s -d 1     \t # Log handler activity\n", app_name);
+    printf("%s -x 100   \t # A full charge takes 30 seconds instead of 50 minutes\n", app_name);
+    printf("%s -c soak.state \t # Resume a soak test after a restart\n", app_name);
+    printf("%s -s -t ems.cap \t # Record an EMS session for regression tests\n", app_name);
+    printf("%s -b tesla230.profile \t # Model taper, losses and ramping\n", app_name);
+    printf("%s -e 9502  \t # Scrape http://127.0.0.1:9502/metrics\n", app_name);
+    printf("%s -a 300   \t # Battery state in registers 300..%d\n", app_name, 300 + TELEMETRY_REGISTERS - 1);
+    printf("%s -f slow.faults \t # Answer like a slow, flaky inverter\n", app_name);
+    printf("%s -g tesla.trace \t # kill -USR1 writes the last stages of every thread, open in Perfetto\n", app_name);
     exit(1);
 }
 
+static void stop(int signo)
+{
+    server_stop();
+}
+
+//
+// CPU list as 0,2,4-7 into cpus, returns the number of cpus or -1
+//
+static int parse_cpus(const char* text, int* cpus, int max)
+{
+    const char* p = text;
+    char* end;
+    long first, last;
+    int count = 0;
+
+    do
+    {
+        first = last = strtol(p, &end, 10);
+        if ( end == p || first < 0 )
+        {
+            return -1;
+        }
+        if ( *end == '-' )
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if ( end == p || last < first )
+            {
+                return -1;
+            }
+        }
+        while ( first <= last && count < max )
+        {
+            cpus[count++] = first++;
+        }
+        p = end + 1;
+    } while ( *end == ',' );
+
+    return *end == '\0' ? count : -1;
+}
+
+//
+// Listen port, optionally followed by the worker count and the cpus to pin
+// the workers to: port[:workers[:cpus]]
+//
+static int parse_port(const char* text, int* port, int* workers, int* cpus, int* cpu_count)
+{
+    char* end;
+
+    *port = strtol(text, &end, 10);
+    if ( end == text || *port <= 0 || *port > 65535 )
+    {
+        return -1;
+    }
+    if ( *end == ':' )
+    {
+        text = end + 1;
+        *workers = strtol(text, &end, 10);
+        if ( end == text || *workers < 1 || *workers > SERVER_WORKERS_MAX )
+        {
+            return -1;
+        }
+    }
+    if ( *end == ':' )
+    {
+        *cpu_count = parse_cpus(end + 1, cpus, SERVER_WORKERS_MAX);
+        return *cpu_count > 0 ? 0 : -1;
+    }
+
+    return *end == '\0' ? 0 : -1;
+}
+
 int main(int argc, char*argv[])
 {
     extern void *handler( void *ptr );
     modbus_t *ctx;
-    int rc, opt, s = -1, port = MODBUS_DEFAULT_PORT;
-    uint16_t holding_register = UT_REGISTERS_NB;
+    int opt, i, port = MODBUS_DEFAULT_PORT;
+    int workers = 1, cpus[SERVER_WORKERS_MAX], cpu_count = 0;
+    int max_connections = SERVER_MAX_CONNECTIONS_DEFAULT;
+    int unit_count = 1;
+    double speed = SIMCLOCK_SPEED_DEFAULT;
+    bool stepped = FALSE;
+    bool udp = FALSE;
+    const char* checkpoint_path = NULL;
+    char checkpoint_name[64];
+    int checkpoint_interval = CHECKPOINT_INTERVAL_DEFAULT;
+    int tick_ms = SIMULATION_TICK_MS_DEFAULT;
+    const char* capture_path = NULL;
+    const char* profile_path = NULL;
+    const char* trace_path = NULL;
+    int metrics_port = 0;
+    long telemetry = telemetryBlock;
+    char* end;
     pthread_t thread1;
-    uint8_t terminate;
-    modbus_mapping_t *mb_mapping;
+    uint8_t terminate = FALSE;
     thread_param_t* thread_param;
-    bool done = FALSE;
-    bool initialised = FALSE;
+    struct sigaction sa;
+    sigset_t signals, dump;
+    int retval;
+
+    // SIGINT and SIGTERM stop the server thread cleanly, they are blocked in
+    // every other thread by starting those with the signals masked
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // SIGUSR1 asks for a trace dump, the trace thread takes it with sigwait
+    // and it stays blocked everywhere else, ignored when not tracing
+    sigemptyset(&dump);
+    sigaddset(&dump, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump, NULL);
 
-    setvbuf(stdout, NULL, _IONBF, 0);                          // disable stdout buffering
+    if ( log_init() == -1 )
+    {
+        printf("Failed to start logger\n");
+        return -1;
+    }
 
-    while ((opt = getopt(argc, argv, "p:")) != -1)
+    while ((opt = getopt(argc, argv, "p:m:un:d:x:sr:c:k:t:b:e:a:f:g:")) != -1)
     {
         switch (opt) {
         case 'p':
-            port = atoi(optarg);
+            if ( parse_port(optarg, &port, &workers, cpus, &cpu_count) == -1 )
+            {
+                usage(*argv);
+            }
             break;
 
-        default:
-            usage(*argv);
-        }
-    }
-    printf("Tesla battery simulator - port (%d)\n", port);
+        case 'm':
+            max_connections = atoi(optarg);
+            if ( max_connections <= 0 )
+            {
+                usage(*argv);
+            }
+            break;
 
-    for (;;)
-    {
-        ctx = modbus_new_tcp(NULL, port);
-        if ( ctx == NULL )
-        {
-            printf("Failed creating modbus context\n");
-            return -1;
-        }
+        case 'u':
+            udp = TRUE;
+            break;
 
-        if ( initialised == FALSE )
-        {
-            mb_mapping = modbus_mapping_new_start_address(
-               0, 0,
-               0, 0,
-               0, UT_REGISTERS_NB,
-               0, 0);
+        case 'n':
+            unit_count = atoi(optarg);
+            if ( unit_count < 1 || unit_count > UNITS_MAX )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'd':
+            log_set_level(LOG_LEVEL_INFO + atoi(optarg));
+            break;
 
-            if (mb_mapping == NULL)
+        case 'x':
+            speed = atof(optarg);
+            if ( speed <= 0.0 )
             {
-                printf("Failed to allocate the mapping: %s\n", modbus_strerror(errno));
-                modbus_free(ctx);
-                return -1;
+                usage(*argv);
             }
-            initialised = TRUE;
-        }
-        thread_param = malloc(sizeof (thread_param_t));
-        terminate = FALSE;
-        thread_param -> ctx = ctx;
-        thread_param -> mb_mapping = mb_mapping;
-        thread_param -> terminate = &terminate;
-        pthread_create( &thread1, NULL, handler, thread_param);
-
-        s = modbus_tcp_listen(ctx, 1);
-        modbus_tcp_accept(ctx, &s);
-        done = FALSE;
-        while (!done)
-        {
-            rc = modbus_receive(ctx, query);
-            switch (rc)
+            break;
+
+        case 's':
+            stepped = TRUE;
+            break;
+
+        case 'r':
+            tick_ms = atoi(optarg);
+            if ( tick_ms < 1 || tick_ms > SIMULATION_TICK_MS_MAX )
             {
-            case -1:
-                close(s); // close the socket
-                modbus_close(ctx);
-                modbus_free(ctx);
-                ctx = NULL;
-                terminate = true;
-                pthread_join( thread1, NULL);
-                done = TRUE;
-                break;
-
-            case 0:
-                // No data received
-                break;
-
-            default:
-                process_query((modbus_pdu_t*)query);
-                continue;
+                usage(*argv);
             }
+            break;
+
+        case 'c':
+            checkpoint_path = optarg;
+            break;
+
+        case 'k':
+            checkpoint_interval = atoi(optarg);
+            if ( checkpoint_interval < 0 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 't':
+            capture_path = optarg;
+            break;
+
+        case 'b':
+            profile_path = optarg;
+            break;
+
+        case 'e':
+            metrics_port = atoi(optarg);
+            if ( metrics_port <= 0 || metrics_port > 65535 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'a':
+            telemetry = strtol(optarg, &end, 10);
+            if ( end == optarg || *end != '\0' || telemetry < 0 || telemetry >= UT_REGISTERS_NB ||
+                 tesla_telemetry(telemetry) == -1 )
+            {
+                usage(*argv);
+            }
+            break;
+
+        case 'f':
+            if ( fault_init(optarg) == -1 )
+            {
+                return -1;
+            }
+            break;
+
+        case 'g':
+            trace_path = optarg;
+            break;
+
+        default:
+            usage(*argv);
         }
-    } // for (;;)
+    }
+    log_info("Tesla battery simulator - port (%d), batteries (%d), workers (%d)\n", port, unit_count, workers);
+    if ( stepped )
+    {
+        log_info("Simulation clock stepped through register %d\n", simulationStep);
+    }
+    else if ( speed != SIMCLOCK_SPEED_DEFAULT )
+    {
+        log_info("Simulation clock running %gx real time\n", speed);
+    }
+    log_info("Simulation tick %d ms\n", tick_ms);
+    simclock_init(speed, stepped);
+    if ( model_init(profile_path) == -1 )
+    {
+        return -1;
+    }
 
-    return 0;
-}
+    ctx = modbus_new_tcp(NULL, port);                          // only its debug flag is used, UDP included
+    if ( ctx == NULL )
+    {
+        log_error("Failed creating modbus context\n");
+        return -1;
+    }
+
+    if ( tesla_init(ctx, unit_count, workers, tick_ms * 1000000ULL) == -1 )
+    {
+        log_error("Failed to allocate the mapping: %s\n", modbus_strerror(errno));
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if ( checkpoint_path == NULL && !stepped )                 // stepped runs start fresh unless asked
+    {
+        snprintf(checkpoint_name, sizeof (checkpoint_name), CHECKPOINT_NAME_FORMAT, port);
+        checkpoint_path = checkpoint_name;
+    }
+    if ( checkpoint_path != NULL && checkpoint_init(checkpoint_path, unit_count, workers, checkpoint_interval) == 0 )
+    {
+        tesla_restore();
+    }
+
+    status_init(port, unit_count);                             // optional, runs without it
+
+    if ( capture_path != NULL && capture_open(capture_path, unit_count, workers, tick_ms * 1000000ULL, telemetry) == -1 )
+    {
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if ( metrics_port != 0 && stats_serve(metrics_port) == -1 )
+    {
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if ( trace_path != NULL && trace_init(trace_path) == -1 )
+    {
+        modbus_free(ctx);
+        return -1;
+    }
+
+    if ( server_init(port, workers, cpus, cpu_count, max_connections, udp) == -1 )
+    {
+        log_error("Failed to listen on port %d\n", port);
+        modbus_free(ctx);
+        return -1;
+    }
+
+    thread_param = malloc(sizeof (thread_param_t));
+    thread_param -> terminate = &terminate;
+    pthread_create( &thread1, NULL, handler, thread_param);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    retval = server_run();                                     // returns on a signal or fatal error
+    for ( i = 0; checkpoint_interval != 0 && i < workers; i++ )
+    {
+        tesla_checkpoint(i);                                   // workers are done, their shards are free
+    }
 
+    terminate = TRUE;
+    simclock_stop();
+    pthread_join( thread1, NULL);
+    stats_stop();
+    trace_stop();
+    modbus_free(ctx);
+
+    return retval;
+}
 
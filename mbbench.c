@@ -0,0 +1,493 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Modbus TCP load generator. Opens many connections to the simulator, keeps
+ * a configurable number of requests in flight on each and issues a weighted
+ * mix of FC3/FC6/FC16/FC23 requests against the tesla register map. Reports
+ * throughput and a latency histogram at the end of the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <byteswap.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tesla.h"
+#include "typedefs.h"
+
+#define BENCH_DEFAULT_HOST          "127.0.0.1"
+#define BENCH_DEFAULT_PORT          1502
+#define BENCH_DEFAULT_CONNECTIONS   64
+#define BENCH_DEFAULT_DURATION      10
+#define BENCH_DEFAULT_MIX           "3:70,6:10,16:10,23:10"
+#define BENCH_PIPELINE_MAX          64                          // power of two
+#define BENCH_MAX_EVENTS            256
+#define BENCH_RX_SIZE               (BENCH_PIPELINE_MAX * MODBUS_TCP_MAX_ADU_LENGTH)
+
+#define HISTOGRAM_SUB_BITS          4                           // 16 sub buckets, ~6% resolution
+#define HISTOGRAM_SUB_COUNT         (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS           (64 * HISTOGRAM_SUB_COUNT)
+
+typedef struct bench_connection_struct
+{
+    int      fd;
+    uint8_t  unit;                                 // unit id addressed, 0 spreads over all
+    uint16_t tid;                                  // next transaction id
+    int      outstanding;                          // requests sent, reply pending
+    uint64_t sent[BENCH_PIPELINE_MAX];             // send time by tid
+    uint8_t  fcode[BENCH_PIPELINE_MAX];            // function code by tid
+    int      length;
+    uint8_t  rx[BENCH_RX_SIZE];
+}bench_connection_t;
+
+typedef struct mix_struct
+{
+    uint8_t  fcode;
+    unsigned weight;
+}mix_t;
+
+// Private data
+static mix_t mix[4];
+static int mix_count = 0;
+static unsigned mix_total = 0;
+static int units = 1;
+static bool sticky = false;
+static bool udp = false;
+static uint64_t histogram[HISTOGRAM_BUCKETS];
+static uint64_t latency_max = 0;
+static uint64_t requests[256];
+static uint64_t exceptions[256];
+static uint64_t mismatches = 0;
+static uint32_t seed = 2463534242u;
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -h \t\t # Simulator address (Default %s)\n", BENCH_DEFAULT_HOST);
+    printf(" -p \t\t # Simulator port (Default %d)\n", BENCH_DEFAULT_PORT);
+    printf(" -c \t\t # Number of connections (Default %d)\n", BENCH_DEFAULT_CONNECTIONS);
+    printf(" -q \t\t # Requests kept in flight per connection, 1..%d (Default 1)\n", BENCH_PIPELINE_MAX);
+    printf(" -d \t\t # Duration in seconds (Default %d)\n", BENCH_DEFAULT_DURATION);
+    printf(" -m \t\t # Function code mix as fc:weight,... (Default %s)\n", BENCH_DEFAULT_MIX);
+    printf(" -u \t\t # Spread requests over unit ids 1..n (Default 1)\n");
+    printf(" -s \t\t # Each connection sticks to one unit id, connection i polls unit 1 + i %% n\n");
+    printf(" -U \t\t # Modbus/UDP, each connection is a socket sending one frame per datagram\n");
+    printf(" -? \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -c 500 -d 30 \t # 500 pollers for 30 seconds\n", app_name);
+    printf("%s -q 8 -m 3:100 \t # Pipelined reads only\n", app_name);
+    printf("%s -c 64 -u 64 -s \t # One poller per battery, as an EMS does\n", app_name);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t random_next(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+//
+// Log linear histogram: exact below 16ns, then 16 sub buckets per power of two
+//
+static int histogram_bucket(uint64_t value)
+{
+    int msb;
+
+    if ( value < HISTOGRAM_SUB_COUNT )
+    {
+        return value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+           ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+static uint64_t histogram_value(int bucket)
+{
+    int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+
+    if ( bucket < HISTOGRAM_SUB_COUNT )
+    {
+        return bucket;
+    }
+    return (uint64_t)(HISTOGRAM_SUB_COUNT + (bucket % HISTOGRAM_SUB_COUNT)) << shift;
+}
+
+static uint64_t histogram_percentile(uint64_t total, double percentile)
+{
+    uint64_t target = (uint64_t)(total * percentile / 100.0), seen = 0;
+    int i;
+
+    for ( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+    {
+        seen += histogram[i];
+        if ( seen > target )
+        {
+            return histogram_value(i);
+        }
+    }
+    return histogram_value(HISTOGRAM_BUCKETS - 1);
+}
+
+static int parse_mix(const char* text)
+{
+    char buffer[128];
+    char *token, *save;
+    unsigned fc, weight;
+
+    snprintf(buffer, sizeof (buffer), "%s", text);
+    for ( token = strtok_r(buffer, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save) )
+    {
+        if ( sscanf(token, "%u:%u", &fc, &weight) != 2 || mix_count == 4 )
+        {
+            return -1;
+        }
+        if ( fc != MODBUS_FC_READ_HOLDING_REGISTERS && fc != MODBUS_FC_WRITE_SINGLE_REGISTER &&
+             fc != MODBUS_FC_WRITE_MULTIPLE_REGISTERS && fc != MODBUS_FC_WRITE_AND_READ_REGISTERS )
+        {
+            return -1;
+        }
+        mix[mix_count].fcode = fc;
+        mix[mix_count].weight = weight;
+        mix_total += weight;
+        mix_count++;
+    }
+    return mix_total ? 0 : -1;
+}
+
+static uint8_t pick_fcode(void)
+{
+    unsigned r = random_next() % mix_total;
+    int i;
+
+    for ( i = 0; i < mix_count - 1; i++ )
+    {
+        if ( r < mix[i].weight )
+        {
+            break;
+        }
+        r -= mix[i].weight;
+    }
+    return mix[i].fcode;
+}
+
+static uint8_t* put_word(uint8_t* p, uint16_t value)
+{
+    *p++ = value >> 8;
+    *p++ = value & 0xFF;
+    return p;
+}
+
+//
+// Build one request against the register map, returns the frame length
+//
+static int build_request(uint8_t* frame, uint16_t tid, uint8_t fc, uint8_t unit)
+{
+    static const uint16_t reads[][2] =
+    {
+        { firmwareVersion,        3 },
+        { statusFullChargeEnergy, 2 },
+        { statusNorminalEnergy,   2 },
+        { statusFullChargeEnergy, 4 },
+    };
+    uint8_t* p = frame + sizeof (mbap_header_t);
+    uint16_t power;
+    int r;
+
+    *p++ = fc;
+    switch ( fc )
+    {
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        r = random_next() % 4;
+        p = put_word(p, reads[r][0]);
+        p = put_word(p, reads[r][1]);
+        break;
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        p = put_word(p, directRealHeartbeat);
+        p = put_word(p, random_next() & 1);
+        break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        power = (random_next() % 461) - 230;           // -230 .. 230 kW
+        p = put_word(p, directPower);
+        p = put_word(p, 2);
+        *p++ = 4;
+        p = put_word(p, (int16_t)power < 0 ? 0xFFFF : 0);
+        p = put_word(p, power);
+        break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        p = put_word(p, statusFullChargeEnergy);
+        p = put_word(p, 4);
+        p = put_word(p, directRealHeartbeat);
+        p = put_word(p, 1);
+        *p++ = 2;
+        p = put_word(p, random_next() & 1);
+        break;
+    }
+
+    put_word(frame, tid);
+    put_word(frame + 2, 0);
+    put_word(frame + 4, (p - frame) - 6);
+    frame[6] = unit ? unit : 1 + (random_next() % units);
+    return p - frame;
+}
+
+static int send_all(int fd, uint8_t* buffer, int length)
+{
+    ssize_t rc;
+
+    while ( length > 0 )
+    {
+        rc = send(fd, buffer, length, MSG_NOSIGNAL);
+        if ( rc == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return -1;
+        }
+        memmove(buffer, buffer + rc, length - rc);
+        length -= rc;
+    }
+    return 0;
+}
+
+//
+// Top up the requests in flight, sent together over TCP and one datagram
+// each over UDP. A lost datagram leaves its slot in flight for good.
+//
+static int fill_pipeline(bench_connection_t* conn, int depth)
+{
+    uint8_t buffer[BENCH_PIPELINE_MAX * MODBUS_TCP_MAX_ADU_LENGTH];
+    int length = 0, slot;
+    uint64_t now = now_ns();
+
+    while ( conn->outstanding < depth )
+    {
+        slot = conn->tid & (BENCH_PIPELINE_MAX - 1);
+        conn->fcode[slot] = pick_fcode();
+        conn->sent[slot] = now;
+        length += build_request(buffer + length, conn->tid, conn->fcode[slot], conn->unit);
+        conn->tid++;
+        conn->outstanding++;
+        if ( udp )
+        {
+            if ( send_all(conn->fd, buffer, length) == -1 )
+            {
+                return -1;
+            }
+            length = 0;
+        }
+    }
+
+    return send_all(conn->fd, buffer, length);
+}
+
+static int drain_replies(bench_connection_t* conn)
+{
+    uint8_t* p;
+    uint16_t tid, length;
+    uint64_t now;
+    ssize_t rc;
+    int remaining, slot;
+
+    rc = recv(conn->fd, conn->rx + conn->length, sizeof (conn->rx) - conn->length, 0);
+    if ( rc <= 0 )
+    {
+        return ( rc == -1 && (errno == EAGAIN || errno == EINTR) ) ? 0 : -1;
+    }
+    conn->length += rc;
+    now = now_ns();
+
+    p = conn->rx;
+    remaining = conn->length;
+    while ( remaining >= (int)sizeof (mbap_header_t) + 1 )
+    {
+        length = (p[4] << 8) | p[5];
+        if ( remaining < 6 + length )
+        {
+            break;
+        }
+        tid = (p[0] << 8) | p[1];
+        slot = tid & (BENCH_PIPELINE_MAX - 1);
+        if ( (p[7] & 0x7F) != conn->fcode[slot] )
+        {
+            mismatches++;
+        }
+        else if ( p[7] & 0x80 )
+        {
+            exceptions[conn->fcode[slot]]++;
+        }
+        requests[conn->fcode[slot]]++;
+        histogram[histogram_bucket(now - conn->sent[slot])]++;
+        if ( now - conn->sent[slot] > latency_max )
+        {
+            latency_max = now - conn->sent[slot];
+        }
+        conn->outstanding--;
+
+        p += 6 + length;
+        remaining -= 6 + length;
+    }
+    memmove(conn->rx, p, remaining);
+    conn->length = remaining;
+    return 0;
+}
+
+static int open_connection(const char* host, int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if ( fd == -1 )
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if ( inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+         connect(fd, (struct sockaddr*)&addr, sizeof (addr)) == -1 )
+    {
+        close(fd);
+        return -1;
+    }
+    if ( !udp )
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    }
+    return fd;
+}
+
+int main(int argc, char*argv[])
+{
+    const char* host = BENCH_DEFAULT_HOST;
+    int opt, i, n, port = BENCH_DEFAULT_PORT;
+    int connections = BENCH_DEFAULT_CONNECTIONS, depth = 1, duration = BENCH_DEFAULT_DURATION;
+    const char* mix_text = BENCH_DEFAULT_MIX;
+    struct epoll_event ev, events[BENCH_MAX_EVENTS];
+    bench_connection_t* conns;
+    uint64_t start, end, total = 0, errors = 0;
+    double seconds;
+    int epoll_fd, open = 0;
+
+    while ((opt = getopt(argc, argv, "h:p:c:q:d:m:u:sU")) != -1)
+    {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'q': depth = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'm': mix_text = optarg; break;
+        case 'u': units = atoi(optarg); break;
+        case 's': sticky = true; break;
+        case 'U': udp = true; break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( connections < 1 || depth < 1 || depth > BENCH_PIPELINE_MAX || duration < 1 ||
+         units < 1 || units > UNITS_MAX || parse_mix(mix_text) == -1 )
+    {
+        usage(*argv);
+    }
+
+    conns = calloc(connections, sizeof (bench_connection_t));
+    epoll_fd = epoll_create1(0);
+    if ( conns == NULL || epoll_fd == -1 )
+    {
+        printf("Out of resources\n");
+        return -1;
+    }
+
+    for ( i = 0; i < connections; i++ )
+    {
+        conns[i].fd = open_connection(host, port);
+        if ( conns[i].fd == -1 )
+        {
+            printf("Failed to connect %d to %s:%d: %s\n", i, host, port, strerror(errno));
+            return -1;
+        }
+        conns[i].unit = ( sticky || units == 1 ) ? 1 + i % units : 0;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+    open = connections;
+
+    start = now_ns();
+    end = start + (uint64_t)duration * 1000000000ULL;
+    for ( i = 0; i < connections; i++ )
+    {
+        fill_pipeline(&conns[i], depth);
+    }
+
+    while ( open > 0 && now_ns() < end )
+    {
+        n = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, 100);
+        for ( i = 0; i < n; i++ )
+        {
+            bench_connection_t* conn = events[i].data.ptr;
+
+            if ( drain_replies(conn) == -1 || fill_pipeline(conn, depth) == -1 )
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                close(conn->fd);
+                errors++;
+                open--;
+            }
+        }
+    }
+    seconds = (now_ns() - start) / 1e9;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        total += requests[i];
+    }
+
+    printf("%s connections %d, pipeline depth %d, units %d%s, duration %.2f s\n", udp ? "udp" : "tcp",
+           connections, depth, units, sticky ? " (one per connection)" : "", seconds);
+    printf("requests %llu, %.0f req/s, connection errors %llu, mismatched replies %llu\n",
+           (unsigned long long)total, total / seconds, (unsigned long long)errors, (unsigned long long)mismatches);
+    for ( i = 0; i < mix_count; i++ )
+    {
+        printf("  FC%-3d %10llu requests %10llu exceptions\n", mix[i].fcode,
+               (unsigned long long)requests[mix[i].fcode], (unsigned long long)exceptions[mix[i].fcode]);
+    }
+    if ( total )
+    {
+        printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+               histogram_percentile(total, 50.0) / 1e3,
+               histogram_percentile(total, 90.0) / 1e3,
+               histogram_percentile(total, 99.0) / 1e3,
+               histogram_percentile(total, 99.9) / 1e3,
+               latency_max / 1e3);
+    }
+
+    return errors ? 1 : 0;
+}
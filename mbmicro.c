@@ -0,0 +1,540 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Micro-benchmarks of the request hot path, no sockets involved. Synthetic
+ * frames are fed to process_query for each function code, process_handler
+ * lookups and process_write_multiple_addresses blocks of 1 to 123 registers
+ * are timed on their own, and reads of growing size show what building the
+ * reply costs. Repeated reads of up to REPLY_CACHE_REGISTERS registers are
+ * answered from the reply cache, longer ones build every reply. The
+ * uncached variants invalidate the cache before each read, as a write does. The battery
+ * model steps fleets of units with the kernel the CPU picks and with the
+ * scalar one. Every benchmark reports ns/op and heap allocations per op.
+ *
+ * Every benchmark is run in several passes over the table and the best pass
+ * is kept, a burst of noise then only costs the pass it hit. Results can be
+ * saved as a baseline (-w) and later runs compared against it (-c),
+ * mbmicro.baseline holds the reference numbers of the tree. The numbers are
+ * machine specific, a comparison only reports the deltas unless -r sets the
+ * slowdown that fails it. More allocations than the baseline always fail. The
+ * simulation thread runs on the stepped clock, it is stepped between timed
+ * chunks so the command queue never fills up and is not timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <modbus/modbus.h>
+#include "tesla.h"
+#include "simclock.h"
+#include "model.h"
+#include "log.h"
+#include "typedefs.h"
+
+#define MBMICRO_DEFAULT_TIME_MS   100                // timed per round
+#define MBMICRO_ROUNDS            5                  // best round is reported
+#define MBMICRO_DEFAULT_PASSES    3                  // passes over the benchmarks, best one is kept
+#define MBMICRO_CHUNK             1024               // ops between simulation steps, below the queue size
+#define MBMICRO_UNITS             2
+#define MBMICRO_BASELINE_MAX      64
+
+typedef enum
+{
+    MICRO_QUERY = 0,                                 // process_query on a frame
+    MICRO_QUERY_UNCACHED,                            // process_query, reply cache invalidated first
+    MICRO_HANDLER,                                   // process_handler of one register
+    MICRO_BLOCK,                                     // process_write_multiple_addresses
+    MICRO_FLEET,                                     // model_fleet_step of count units
+    MICRO_FLEET_SCALAR                               // model_fleet_step_scalar of count units
+}micro_kind_t;
+
+typedef struct micro_struct
+{
+    const char* name;
+    micro_kind_t kind;
+    uint8_t  unit_id;
+    uint8_t  fcode;
+    uint16_t address;                                // write address of FC23
+    uint16_t count;                                  // registers, write count of FC23
+    uint16_t read_address;                           // FC23 only
+    uint16_t read_count;
+    uint8_t  expect;                                 // exception code the op must return, 0 for success
+}micro_t;
+
+typedef struct baseline_struct
+{
+    char     name[32];
+    double   ns;
+    double   allocs;
+}baseline_t;
+
+//
+// Benchmarks, names are the keys of the baseline file
+//
+static const micro_t micro_table[] =
+{
+    {"query/fc3/x4",             MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 4,   0, 0, 0},
+    {"query/fc6",                MICRO_QUERY,   1, MODBUS_FC_WRITE_SINGLE_REGISTER,    realMode,               1,   0, 0, 0},
+    {"query/fc16/x2",            MICRO_QUERY,   1, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, directPower,            2,   0, 0, 0},
+    {"query/fc16/x123",          MICRO_QUERY,   1, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 1024,                   123, 0, 0, 0},
+    {"query/fc23/x2x4",          MICRO_QUERY,   1, MODBUS_FC_WRITE_AND_READ_REGISTERS, directPower,            2,   statusFullChargeEnergy, 4, 0},
+    {"query/no-unit",            MICRO_QUERY,   9, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 4,   0, 0, MODBUS_EXCEPTION_GATEWAY_TARGET},
+    {"query/illegal-function",   MICRO_QUERY,   1, 0x2B,                               0,                      0,   0, 0, MODBUS_EXCEPTION_ILLEGAL_FUNCTION},
+    {"query/illegal-address",    MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   0,                      4,   0, 0, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS},
+    {"handler/hit",              MICRO_HANDLER, 1, 0,                                  realMode,               1,   0, 0, 0},
+    {"handler/command",          MICRO_HANDLER, 1, 0,                                  directPower + 1,        1,   0, 0, 0},
+    {"handler/miss",             MICRO_HANDLER, 1, 0,                                  500,                    1,   0, 0, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS},
+    {"block/x1",                 MICRO_BLOCK,   1, 0,                                  1024,                   1,   0, 0, 0},
+    {"block/x2",                 MICRO_BLOCK,   1, 0,                                  1024,                   2,   0, 0, 0},
+    {"block/x4",                 MICRO_BLOCK,   1, 0,                                  1024,                   4,   0, 0, 0},
+    {"block/x8",                 MICRO_BLOCK,   1, 0,                                  1024,                   8,   0, 0, 0},
+    {"block/x16",                MICRO_BLOCK,   1, 0,                                  1024,                   16,  0, 0, 0},
+    {"block/x32",                MICRO_BLOCK,   1, 0,                                  1024,                   32,  0, 0, 0},
+    {"block/x64",                MICRO_BLOCK,   1, 0,                                  1024,                   64,  0, 0, 0},
+    {"block/x123",               MICRO_BLOCK,   1, 0,                                  1024,                   123, 0, 0, 0},
+    {"block/handlers/x24",       MICRO_BLOCK,   1, 0,                                  realMode,               24,  0, 0, 0},
+    {"query/telemetry",          MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   telemetryBlock,         TELEMETRY_REGISTERS, 0, 0, 0},
+    {"query/telemetry/uncached", MICRO_QUERY_UNCACHED, 1, MODBUS_FC_READ_HOLDING_REGISTERS, telemetryBlock,       TELEMETRY_REGISTERS, 0, 0, 0},
+    {"query/fc3/x4/uncached",    MICRO_QUERY_UNCACHED, 1, MODBUS_FC_READ_HOLDING_REGISTERS, statusFullChargeEnergy, 4,   0, 0, 0},
+    {"reply/fc3/x1",             MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 1,   0, 0, 0},
+    {"reply/fc3/x16",            MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 16,  0, 0, 0},
+    {"reply/fc3/x64",            MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 64,  0, 0, 0},
+    {"reply/fc3/x125",           MICRO_QUERY,   1, MODBUS_FC_READ_HOLDING_REGISTERS,   statusFullChargeEnergy, 125, 0, 0, 0},
+    {"reply/fc3/x1/uncached",    MICRO_QUERY_UNCACHED, 1, MODBUS_FC_READ_HOLDING_REGISTERS, statusFullChargeEnergy, 1,   0, 0, 0},
+    {"reply/fc3/x16/uncached",   MICRO_QUERY_UNCACHED, 1, MODBUS_FC_READ_HOLDING_REGISTERS, statusFullChargeEnergy, 16,  0, 0, 0},
+    {"engine/x1024",             MICRO_FLEET,   0, 0,                                  0,                      1024,  0, 0, 0},
+    {"engine/x1024/scalar",      MICRO_FLEET_SCALAR, 0, 0,                             0,                      1024,  0, 0, 0},
+    {"engine/x32768",            MICRO_FLEET,   0, 0,                                  0,                      32768, 0, 0, 0},
+    {"engine/x32768/scalar",     MICRO_FLEET_SCALAR, 0, 0,                             0,                      32768, 0, 0, 0},
+    {NULL,                       0,             0, 0,                                  0,                      0,   0, 0, 0}
+};
+
+#define MBMICRO_BENCHMARKS        (sizeof (micro_table) / sizeof (micro_table[0]) - 1)
+
+// Private data
+static uint8_t frame[MODBUS_TCP_MAX_ADU_LENGTH];
+static uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+static uint8_t block[MODBUS_MAX_WRITE_REGISTERS * 2];
+static fleet_t fleet;                                // model benchmarks
+static baseline_t baseline[MBMICRO_BASELINE_MAX];
+static int baseline_count = 0;
+static __thread uint64_t allocations = 0;            // heap allocations made by the benchmark thread
+
+//
+// The Makefile links mbmicro with --wrap for the allocator, every allocation
+// made by the simulator code is counted here
+//
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -t \t\t # Time per round in ms, best of %d rounds is reported (Default %d)\n", MBMICRO_ROUNDS, MBMICRO_DEFAULT_TIME_MS);
+    printf(" -n \t\t # Passes over the benchmarks, the best one is kept (Default %d)\n", MBMICRO_DEFAULT_PASSES);
+    printf(" -f \t\t # Only run benchmarks whose name contains the text\n");
+    printf(" -w \t\t # Save the results as a baseline file\n");
+    printf(" -c \t\t # Compare against a baseline file, exit 1 on a regression\n");
+    printf(" -r \t\t # Percent slower than the baseline counted as a regression (Default none, only more allocations)\n");
+    printf(" -l \t\t # List the benchmarks\n");
+    printf(" -? \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -c mbmicro.baseline \t # Show how a hot path change compares to the tree\n", app_name);
+    printf("%s -c mbmicro.baseline -r 10 # Fail when a benchmark is 10%% slower\n", app_name);
+    printf("%s -f block -t 500    \t # Only the block writes, longer rounds\n", app_name);
+    exit(1);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * SIMCLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+static uint8_t* put_word(uint8_t* p, uint16_t value)
+{
+    *p++ = value >> 8;
+    *p++ = value & 0xFF;
+    return p;
+}
+
+//
+// Build the request frame of a query benchmark
+//
+static void build_frame(const micro_t* m)
+{
+    uint8_t* p = frame + sizeof (mbap_header_t);
+    int i;
+
+    *p++ = m->fcode;
+    switch ( m->fcode )
+    {
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        p = put_word(p, m->address);
+        p = put_word(p, m->count);
+        break;
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        p = put_word(p, m->address);
+        p = put_word(p, 1);
+        break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        p = put_word(p, m->address);
+        p = put_word(p, m->count);
+        *p++ = m->count * 2;
+        for ( i = 0; i < m->count; i++ )
+        {
+            p = put_word(p, i);
+        }
+        break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        p = put_word(p, m->read_address);
+        p = put_word(p, m->read_count);
+        p = put_word(p, m->address);
+        p = put_word(p, m->count);
+        *p++ = m->count * 2;
+        for ( i = 0; i < m->count; i++ )
+        {
+            p = put_word(p, i);
+        }
+        break;
+    }
+
+    put_word(frame, 1);
+    put_word(frame + 2, 0);
+    put_word(frame + 4, (p - frame) - 6);
+    frame[6] = m->unit_id;
+}
+
+//
+// Fleet of a model benchmark, set points and SoC spread over their range so
+// that every branch of the model is taken
+//
+static int build_fleet(int count)
+{
+    battery_t battery;
+    int i;
+
+    model_fleet_free(&fleet);
+    if ( model_fleet_init(&fleet, count) == -1 )
+    {
+        return -1;
+    }
+    memset(&battery, 0, sizeof (battery));
+    for ( i = 0; i < count; i++ )
+    {
+        battery.power = (i * 37) % 461 - 230;
+        battery.state_of_charge = (i * 13) % 1001 / 10.0;
+        model_fleet_load(&fleet, i, &battery);
+    }
+    return 0;
+}
+
+//
+// One operation, returns 0 or the exception code
+//
+static inline int micro_op(const micro_t* m, unit_t* unit)
+{
+    modbus_pdu_t* rsp = (modbus_pdu_t*)reply;
+
+    switch ( m->kind )
+    {
+    case MICRO_QUERY:
+        process_query((modbus_pdu_t*)frame, reply);
+        return ( rsp->fcode & 0x80 ) ? rsp->data[0] : 0;
+
+    case MICRO_QUERY_UNCACHED:
+        unit->reply_epoch++;                         // as a write would
+        process_query((modbus_pdu_t*)frame, reply);
+        return ( rsp->fcode & 0x80 ) ? rsp->data[0] : 0;
+
+    case MICRO_HANDLER:
+        return process_handler(unit, m->address, 1);
+
+    case MICRO_BLOCK:
+        return process_write_multiple_addresses(unit, m->address, m->count, block);
+
+    case MICRO_FLEET:
+        model_fleet_step(&fleet, 0.1f);
+        return 0;
+
+    case MICRO_FLEET_SCALAR:
+        model_fleet_step_scalar(&fleet, 0.1f);
+        return 0;
+    }
+    return -1;
+}
+
+//
+// Time a benchmark in chunks of MBMICRO_CHUNK ops, the simulation is stepped
+// outside of the timed part. Returns the best ns/op of the rounds, -1 if the
+// op does not return what the benchmark expects.
+//
+static double micro_run(const micro_t* m, uint64_t round_ns, double* allocs_per_op)
+{
+    unit_t* unit = unit_lookup(m->unit_id);
+    uint64_t start, busy, ops, total_ops = 0, allocated;
+    double ns, best = -1;
+    int round, i, retval = 0;
+
+    if ( m->kind == MICRO_QUERY || m->kind == MICRO_QUERY_UNCACHED )
+    {
+        build_frame(m);
+    }
+    if ( (m->kind == MICRO_FLEET || m->kind == MICRO_FLEET_SCALAR) && build_fleet(m->count) == -1 )
+    {
+        return -1;
+    }
+    if ( micro_op(m, unit) != m->expect )
+    {
+        return -1;
+    }
+
+    allocated = allocations;
+    for ( round = 0; round < MBMICRO_ROUNDS; round++ )
+    {
+        busy = ops = 0;
+        while ( busy < round_ns )
+        {
+            start = monotonic_ns();
+            for ( i = 0; i < MBMICRO_CHUNK; i++ )
+            {
+                retval |= micro_op(m, unit);
+            }
+            busy += monotonic_ns() - start;
+            ops += MBMICRO_CHUNK;
+            simclock_step(SIMCLOCK_NS_PER_SEC / 10);
+        }
+        ns = (double)busy / ops;
+        best = ( best < 0 || ns < best ) ? ns : best;
+        total_ops += ops;
+    }
+    if ( retval != m->expect )
+    {
+        return -1;
+    }
+
+    *allocs_per_op = (double)(allocations - allocated) / total_ops;
+    return best;
+}
+
+static int baseline_load(const char* path)
+{
+    char line[128];
+    FILE* fp;
+
+    fp = fopen(path, "r");
+    if ( fp == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+    while ( fgets(line, sizeof (line), fp) != NULL && baseline_count < MBMICRO_BASELINE_MAX )
+    {
+        baseline_t* b = &baseline[baseline_count];
+
+        if ( line[0] == '#' || sscanf(line, "%31s %lf %lf", b->name, &b->ns, &b->allocs) != 3 )
+        {
+            continue;
+        }
+        baseline_count++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static const baseline_t* baseline_find(const char* name)
+{
+    int i;
+
+    for ( i = 0; i < baseline_count; i++ )
+    {
+        if ( strcmp(baseline[i].name, name) == 0 )
+        {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char*argv[])
+{
+    const micro_t* m;
+    const baseline_t* b;
+    thread_param_t* thread_param;
+    pthread_t thread1;
+    modbus_t* ctx;
+    FILE* out = NULL;
+    uint8_t terminate = FALSE;
+    const char *filter = NULL, *save_path = NULL, *compare_path = NULL;
+    uint64_t round_ns = MBMICRO_DEFAULT_TIME_MS * 1000000ULL;
+    double ns, allocs, delta, tolerance = -1;
+    double best_ns[MBMICRO_BENCHMARKS], best_allocs[MBMICRO_BENCHMARKS];
+    int opt, pass, passes = MBMICRO_DEFAULT_PASSES, i, regressions = 0, failures = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:f:w:c:r:l")) != -1)
+    {
+        switch (opt) {
+        case 't': round_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+        case 'n': passes = atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'w': save_path = optarg; break;
+        case 'c': compare_path = optarg; break;
+        case 'r': tolerance = atof(optarg); break;
+        case 'l':
+            for ( m = micro_table; m->name != NULL; m++ )
+            {
+                printf("%s\n", m->name);
+            }
+            return 0;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( round_ns == 0 || passes < 1 || optind != argc )
+    {
+        usage(*argv);
+    }
+    if ( compare_path != NULL && baseline_load(compare_path) == -1 )
+    {
+        return -1;
+    }
+
+    if ( log_init() == -1 )
+    {
+        return -1;
+    }
+    log_set_level(LOG_LEVEL_WARN);
+    simclock_init(SIMCLOCK_SPEED_DEFAULT, true);
+    ctx = modbus_new_tcp("127.0.0.1", 0);                  // never connected, only debug output uses it
+    if ( model_init(NULL) == -1 || ctx == NULL ||
+         tesla_init(ctx, MBMICRO_UNITS, 1, SIMULATION_TICK_MS_DEFAULT * 1000000ULL) == -1 )
+    {
+        printf("Failed to create the simulator\n");
+        return -1;
+    }
+    thread_param = malloc(sizeof (thread_param_t));
+    thread_param -> terminate = &terminate;
+    pthread_create( &thread1, NULL, handler, thread_param);
+
+    if ( save_path != NULL )
+    {
+        out = fopen(save_path, "w");
+        if ( out == NULL )
+        {
+            perror(save_path);
+            return -1;
+        }
+        fprintf(out, "# mbmicro baseline: benchmark ns/op allocs/op\n");
+    }
+
+    for ( i = 0; i < MBMICRO_BENCHMARKS; i++ )
+    {
+        best_ns[i] = 0;                                     // not run
+        best_allocs[i] = 0;
+    }
+    for ( pass = 0; pass < passes; pass++ )
+    {
+        for ( m = micro_table, i = 0; m->name != NULL; m++, i++ )
+        {
+            if ( (filter != NULL && strstr(m->name, filter) == NULL) || best_ns[i] < 0 )
+            {
+                continue;
+            }
+            ns = micro_run(m, round_ns, &allocs);
+            if ( ns < 0 )
+            {
+                best_ns[i] = -1;                            // failed, not run again
+                continue;
+            }
+            best_ns[i] = ( best_ns[i] == 0 || ns < best_ns[i] ) ? ns : best_ns[i];
+            best_allocs[i] = ( allocs > best_allocs[i] ) ? allocs : best_allocs[i];
+        }
+    }
+
+    printf("%-24s %10s %10s", "benchmark", "ns/op", "allocs/op");
+    printf(baseline_count ? " %10s %8s\n" : "\n", "baseline", "delta");
+    for ( m = micro_table, i = 0; m->name != NULL; m++, i++ )
+    {
+        ns = best_ns[i];
+        allocs = best_allocs[i];
+        if ( ns == 0 )
+        {
+            continue;
+        }
+        if ( ns < 0 )
+        {
+            printf("%-24s failed, the op did not return %d\n", m->name, m->expect);
+            failures++;
+            continue;
+        }
+        printf("%-24s %10.1f %10.2f", m->name, ns, allocs);
+        b = baseline_find(m->name);
+        if ( b != NULL )
+        {
+            delta = ( b->ns > 0 ) ? (ns - b->ns) * 100.0 / b->ns : 0;
+            printf(" %10.1f %+7.1f%%", b->ns, delta);
+            if ( (tolerance >= 0 && delta > tolerance) || allocs > b->allocs )
+            {
+                printf("  regression");
+                regressions++;
+            }
+        }
+        printf("\n");
+        if ( out != NULL )
+        {
+            fprintf(out, "%s %.1f %.2f\n", m->name, ns, allocs);
+        }
+    }
+    if ( out != NULL )
+    {
+        fclose(out);
+    }
+
+    terminate = TRUE;
+    simclock_stop();
+    pthread_join( thread1, NULL);
+    modbus_free(ctx);
+
+    if ( baseline_count )
+    {
+        if ( tolerance >= 0 )
+        {
+            printf("%d regressions beyond %.0f%% against %s\n", regressions, tolerance, compare_path);
+        }
+        else
+        {
+            printf("%d regressions in allocations against %s, timings not checked without -r\n", regressions, compare_path);
+        }
+    }
+    return ( failures || regressions ) ? 1 : 0;
+}
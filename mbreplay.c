@@ -0,0 +1,298 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Replays a capture recorded with tesla -t straight into process_query, no
+ * sockets involved, and checks every reply against the recorded one. The
+ * simulation runs on the stepped clock and is stepped before each frame until
+ * it has completed as many ticks as it had when the frame was recorded, so
+ * ticks fall between the same frames as they did live, in real time or
+ * stepped, and a session replays deterministically. A live simulation steps
+ * the ticks of an overrun one by one too. A write that reaches the simulation
+ * while a tick is applying commands can still replay a tick later than it ran
+ * live, which only fast ticks make likely. Version 1 captures carry no tick
+ * count and are stepped to the simulation time of each frame, which only
+ * matches stepped sessions.
+ *
+ * Replies to reads of perfCounters are not compared, they are the live
+ * process counters and never replay.
+ *
+ * Frames are fed as fast as possible unless -o asks for the original pacing.
+ * The time spent in process_query is reported on its own, it measures decode
+ * and dispatch in isolation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <modbus/modbus.h>
+#include "capture.h"
+#include "tesla.h"
+#include "simclock.h"
+#include "model.h"
+#include "log.h"
+#include "fault.h"
+#include "stats.h"
+#include "typedefs.h"
+
+#define MBREPLAY_MISMATCH_SHOWN   10
+
+//
+// Record of a version 1 capture
+//
+typedef struct capture_record_v1_struct
+{
+    uint64_t time;
+    uint64_t sim_time;
+    uint32_t session;
+    uint16_t query_length;
+    uint16_t reply_length;
+}capture_record_v1_t;
+
+// Private data
+static uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+static uint8_t expected[MODBUS_TCP_MAX_ADU_LENGTH];
+static uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ... capture_file\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -o \t\t # Replay at the original pacing (Default as fast as possible)\n");
+    printf(" -v \t\t # Show every mismatched reply (Default first %d)\n", MBREPLAY_MISMATCH_SHOWN);
+    printf(" -b \t\t # Battery profile the capture was recorded with (Default linear model)\n");
+    printf(" -f \t\t # Fault profile the capture was recorded with\n");
+    printf(" -d \t\t # Set log level of the simulator, 0 info, 1 debug, 2 trace (Default warnings only)\n");
+    printf(" -? \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s ems.cap      \t # Regression test against a recorded session\n", app_name);
+    printf("%s -o ems.cap   \t # Reproduce a session with its real timing\n", app_name);
+    exit(1);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * SIMCLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+static void print_frame(const char* label, const uint8_t* p, int length)
+{
+    int i;
+
+    printf("  %-8s", label);
+    for ( i = 0; i < length; i++ )
+    {
+        printf(" %02x", p[i]);
+    }
+    printf("\n");
+}
+
+//
+// Next record of the capture, version 1 records are read into the current
+// layout without a tick count. Returns -1 at the end of the file.
+//
+static int read_record(FILE* fp, int version, capture_record_t* record)
+{
+    capture_record_v1_t v1;
+
+    if ( version != 1 )
+    {
+        return ( fread(record, sizeof (*record), 1, fp) == 1 ) ? 0 : -1;
+    }
+    if ( fread(&v1, sizeof (v1), 1, fp) != 1 )
+    {
+        return -1;
+    }
+    memset(record, 0, sizeof (*record));
+    record->time = v1.time;
+    record->sim_time = v1.sim_time;
+    record->session = v1.session;
+    record->query_length = v1.query_length;
+    record->reply_length = v1.reply_length;
+    return 0;
+}
+
+//
+// Whether a query reads perfCounters, whose replies are not compared
+//
+static bool reads_counters(const uint8_t* frame, int length)
+{
+    const modbus_pdu_t* mb = (const modbus_pdu_t*)frame;
+    int offset, address, count;
+
+    if ( mb->fcode != MODBUS_FC_READ_HOLDING_REGISTERS && mb->fcode != MODBUS_FC_WRITE_AND_READ_REGISTERS )
+    {
+        return false;
+    }
+    offset = sizeof (mbap_header_t) + 1;
+    if ( length < offset + 4 )
+    {
+        return false;
+    }
+    address = (frame[offset] << 8) | frame[offset + 1];
+    count = (frame[offset + 2] << 8) | frame[offset + 3];
+    return address < perfCounters + STATS_REGISTERS && perfCounters < address + count;
+}
+
+static void pace(uint64_t start, uint64_t offset)
+{
+    struct timespec ts;
+    uint64_t wall = start + offset;
+
+    ts.tv_sec = wall / SIMCLOCK_NS_PER_SEC;
+    ts.tv_nsec = wall % SIMCLOCK_NS_PER_SEC;
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 )
+    {
+    }
+}
+
+int main(int argc, char*argv[])
+{
+    capture_header_t header;
+    capture_record_t record;
+    thread_param_t* thread_param;
+    pthread_t thread1;
+    modbus_t* ctx;
+    FILE* fp;
+    uint64_t frames = 0, mismatches = 0, unchecked = 0, busy = 0, start, elapsed, t0, now, tick;
+    uint8_t terminate = FALSE;
+    bool original = false, verbose = false;
+    const char* profile_path = NULL;
+    const char* fault_path = NULL;
+    int opt, length, shards, level = LOG_LEVEL_WARN;
+
+    while ((opt = getopt(argc, argv, "ovd:b:f:")) != -1)
+    {
+        switch (opt) {
+        case 'o': original = true; break;
+        case 'v': verbose = true; break;
+        case 'd': level = LOG_LEVEL_INFO + atoi(optarg); break;
+        case 'b': profile_path = optarg; break;
+        case 'f': fault_path = optarg; break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( optind != argc - 1 )
+    {
+        usage(*argv);
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if ( fp == NULL )
+    {
+        perror(argv[optind]);
+        return -1;
+    }
+    if ( fread(&header, sizeof (header), 1, fp) != 1 || header.magic != CAPTURE_MAGIC ||
+         header.version < 1 || header.version > CAPTURE_VERSION || header.unit_count < 1 || header.unit_count > UNITS_MAX )
+    {
+        printf("%s is not a capture file\n", argv[optind]);
+        return -1;
+    }
+
+    if ( log_init() == -1 )
+    {
+        return -1;
+    }
+    log_set_level(level);
+    simclock_init(SIMCLOCK_SPEED_DEFAULT, true);
+    if ( model_init(profile_path) == -1 || (fault_path != NULL && fault_init(fault_path) == -1) )
+    {
+        return -1;
+    }
+    ctx = modbus_new_tcp("127.0.0.1", 0);                  // never connected, only debug output uses it
+    tick = header.tick_us ? header.tick_us * 1000ULL : SIMCLOCK_NS_PER_SEC;    // same ticks as the capture
+    shards = header.shards ? header.shards : 1;                                  // and command queues
+    if ( ctx == NULL || tesla_telemetry(header.telemetry) == -1 ||                // and register map
+         tesla_init(ctx, header.unit_count, shards, tick) == -1 )
+    {
+        printf("Failed to create %d units\n", header.unit_count);
+        return -1;
+    }
+
+    thread_param = malloc(sizeof (thread_param_t));
+    thread_param -> terminate = &terminate;
+    pthread_create( &thread1, NULL, handler, thread_param);
+    simclock_step(0);                                      // simulation thread waiting on its first tick
+
+    start = monotonic_ns();
+    while ( read_record(fp, header.version, &record) == 0 )
+    {
+        if ( record.query_length > sizeof (query) || record.reply_length > sizeof (expected) ||
+             fread(query, 1, record.query_length, fp) != record.query_length ||
+             fread(expected, 1, record.reply_length, fp) != record.reply_length )
+        {
+            printf("Truncated record after %llu frames\n", (unsigned long long)frames);
+            break;
+        }
+
+        if ( original )
+        {
+            pace(start, record.time);
+        }
+        if ( header.version == 1 )
+        {
+            now = simclock_now();
+            if ( record.sim_time > now )
+            {
+                simclock_step(record.sim_time - now);
+            }
+        }
+        else if ( (int32_t)(record.tick - tesla_ticks()) > 0 )
+        {
+            simclock_step((uint64_t)(record.tick - tesla_ticks()) * tick);
+        }
+
+        t0 = monotonic_ns();
+        length = process_query((modbus_pdu_t*)query, reply);
+        busy += monotonic_ns() - t0;
+        frames++;
+        if ( query_stepped )
+        {
+            simclock_step(0);                                  // a live reply waits for the step too
+            query_stepped = false;
+        }
+
+        if ( reads_counters(query, record.query_length) )
+        {
+            unchecked++;
+        }
+        else if ( length != record.reply_length || memcmp(reply, expected, length) != 0 )
+        {
+            if ( verbose || mismatches < MBREPLAY_MISMATCH_SHOWN )
+            {
+                printf("Mismatch at frame %llu, session %u, %.3f s into the capture\n",
+                       (unsigned long long)frames, record.session, record.time / 1e9);
+                print_frame("query", query, record.query_length);
+                print_frame("expected", expected, record.reply_length);
+                print_frame("got", reply, length);
+            }
+            mismatches++;
+        }
+    }
+    elapsed = monotonic_ns() - start;
+    fclose(fp);
+
+    terminate = TRUE;
+    simclock_stop();
+    pthread_join( thread1, NULL);
+    modbus_free(ctx);
+
+    printf("frames %llu, mismatched replies %llu, perfCounters reads not compared %llu, simulated %.1f s\n",
+           (unsigned long long)frames, (unsigned long long)mismatches, (unsigned long long)unchecked, simclock_now() / 1e9);
+    if ( frames )
+    {
+        printf("replay %.3f s, %.0f frames/s, process_query %.1f ns/frame\n", elapsed / 1e9,
+               frames / (elapsed / 1e9), (double)busy / frames);
+    }
+
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Reader for the simulator live status segment (see status.h). Prints the
+ * state of every unit, optionally refreshing, or exports it to a JSON file at
+ * a low rate. Samples are read straight from shared memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "status.h"
+#include "seqlock.h"
+
+#define MBSTATUS_DEFAULT_PORT       1502
+#define MBSTATUS_JSON_INTERVAL      5                   // seconds
+
+// Private data
+static const status_header_t* header;
+static const uint8_t* segment;
+static size_t segment_size;
+
+static const char* status_text[] = { "idle", "charging", "discharging" };
+
+
+static void usage(const char *app_name)
+{
+    printf("Usage:\n");
+    printf("%s [option <value>] ...\n", app_name);
+    printf("\nOptions:\n");
+    printf(" -p \t\t # Port of the simulator to read (Default %d)\n", MBSTATUS_DEFAULT_PORT);
+    printf(" -w \t\t # Refresh the table every n milliseconds\n");
+    printf(" -j \t\t # Export to a JSON file instead of printing\n");
+    printf(" -i \t\t # JSON export period in seconds (Default %d)\n", MBSTATUS_JSON_INTERVAL);
+    printf(" -? \t\t # Print this help menu\n");
+    printf("\nExamples:\n");
+    printf("%s -w 500       \t # Watch the simulator on port 1502\n", app_name);
+    printf("%s -j soc.json  \t # Keep soc.json up to date\n", app_name);
+    exit(1);
+}
+
+static int status_open(int port)
+{
+    char name[32];
+    struct stat st;
+    void* p;
+    int fd;
+
+    snprintf(name, sizeof (name), STATUS_NAME_FORMAT, port);
+    fd = shm_open(name, O_RDONLY, 0);
+    if ( fd == -1 )
+    {
+        printf("No status segment %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if ( fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof (status_header_t) )
+    {
+        printf("Status segment %s is not initialised\n", name);
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( p == MAP_FAILED )
+    {
+        printf("mmap %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    segment = p;
+    segment_size = st.st_size;
+    header = p;
+    if ( __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC || header->version != STATUS_VERSION ||
+         header->header_size + (size_t)header->unit_count * header->record_size > segment_size )
+    {
+        printf("Status segment %s has an unknown layout\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void status_read(int index, status_record_t* record)
+{
+    const status_record_t* shared = (const status_record_t*)(segment + header->header_size + index * header->record_size);
+    uint32_t sequence;
+
+    do
+    {
+        sequence = seqlock_read_begin(&shared->sequence);
+        memcpy(record, shared, sizeof (*record));
+    } while ( seqlock_read_retry(&shared->sequence, sequence) );
+}
+
+static const char* status_name(uint8_t status)
+{
+    return status <= STATUS_DISCHARGING ? status_text[status] : "unknown";
+}
+
+static void print_table(void)
+{
+    status_record_t record;
+    int i;
+
+    printf("pid %u, ticks %llu of %u us, late avg %u us max %u us, overruns %u\n", header->pid,
+           (unsigned long long)header->ticks, header->tick_us, header->late_avg_us, header->late_max_us, header->overruns);
+    printf("%5s %8s %-12s %8s %8s %10s %10s\n", "unit", "soc %", "status", "set kW", "out kW", "hb age s", "sim s");
+    for ( i = 0; i < header->unit_count; i++ )
+    {
+        status_read(i, &record);
+        printf("%5d %8.3f %-12s %8d %8.1f %10u %10.1f\n", record.unit_id, record.state_of_charge,
+               status_name(record.status), record.power, record.output, record.heartbeat_age, record.sim_time / 1e9);
+    }
+}
+
+//
+// Write to a temporary file and rename it, readers never see a partial file
+//
+static int export_json(const char* filename)
+{
+    char temporary[256];
+    status_record_t record;
+    FILE *fp;
+    int i;
+
+    snprintf(temporary, sizeof (temporary), "%s.tmp", filename);
+    fp = fopen(temporary, "w");
+    if ( fp == NULL )
+    {
+        return -1;
+    }
+
+    status_read(0, &record);
+    fprintf(fp,
+            "{" \
+                "\"stateOfCharge\": {"  \
+                    "\"charge\":\"%f\", " \
+                    "\"status\":\"%s\", " \
+                    "\"time\":\"%08ld\" " \
+                "}, " \
+                "\"units\": [",
+            record.state_of_charge, status_name(record.status), (long)(record.wall_time / 1000000000ULL));
+    for ( i = 0; i < header->unit_count; i++ )
+    {
+        status_read(i, &record);
+        fprintf(fp, "%s{\"unit\":%d, \"charge\":%f, \"status\":\"%s\", \"power\":%d, \"output\":%.1f, \"heartbeatAge\":%u, \"time\":%ld}",
+                i ? ", " : "", record.unit_id, record.state_of_charge, status_name(record.status),
+                record.power, record.output, record.heartbeat_age, (long)(record.wall_time / 1000000000ULL));
+    }
+    fprintf(fp, "]}\n");
+
+    if ( fclose(fp) != 0 || rename(temporary, filename) == -1 )
+    {
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char*argv[])
+{
+    int opt, port = MBSTATUS_DEFAULT_PORT, watch = 0, interval = MBSTATUS_JSON_INTERVAL;
+    const char* json = NULL;
+
+    while ((opt = getopt(argc, argv, "p:w:j:i:")) != -1)
+    {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'w': watch = atoi(optarg); break;
+        case 'j': json = optarg; break;
+        case 'i': interval = atoi(optarg); break;
+        default:
+            usage(*argv);
+        }
+    }
+    if ( watch < 0 || interval < 1 )
+    {
+        usage(*argv);
+    }
+
+    if ( status_open(port) == -1 )
+    {
+        return -1;
+    }
+
+    if ( json )
+    {
+        for (;;)
+        {
+            if ( export_json(json) == -1 )
+            {
+                printf("Failed to write %s: %s\n", json, strerror(errno));
+            }
+            sleep(interval);
+        }
+    }
+
+    for (;;)
+    {
+        print_table();
+        if ( watch == 0 )
+        {
+            break;
+        }
+        usleep(watch * 1000);
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,510 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Table driven battery model. A profile is a text file of "key = value"
+ * lines, a value is either a number or a curve of "x:y" points joined by
+ * straight lines and flat beyond its ends:
+ *
+ *   rating               = 230                 # kW
+ *   capacity             = 191.7               # kWh
+ *   ramp                 = 50                  # kW per second, 0 steps at once
+ *   charge_limit         = 0:230 85:230 100:20 # kW by SoC %, taper near full
+ *   discharge_limit      = 0:20 10:230         # kW by SoC %, taper near empty
+ *   charge_efficiency    = 0:0.90 100:0.97     # by power, % of rating
+ *   discharge_efficiency = 0.95
+ *   efficiency           = 0.92                # round trip, split evenly
+ *
+ * Without a profile the model is the original linear one: 230kW charges
+ * from empty in 3000s, discharges from full in 2800s, no ramp and no limits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "model.h"
+#include "log.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define MODEL_LINE_LENGTH        256
+
+typedef struct curve_struct
+{
+    int   count;
+    float x[MODEL_CURVE_POINTS];
+    float y[MODEL_CURVE_POINTS];
+}curve_t;
+
+typedef struct profile_struct
+{
+    float   rating;
+    float   capacity;
+    float   ramp;
+    curve_t charge_limit;
+    curve_t discharge_limit;
+    curve_t charge_efficiency;
+    curve_t discharge_efficiency;
+}profile_t;
+
+// Private data
+static model_t model;
+static void (*step_kernel)(fleet_t*, float) = model_fleet_step_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+static void model_fleet_step_avx2(fleet_t* fleet, float seconds);
+#endif
+
+
+static void curve_constant(curve_t* curve, float value)
+{
+    curve->count = 1;
+    curve->x[0] = 0.0f;
+    curve->y[0] = value;
+}
+
+static float curve_value(const curve_t* curve, float x)
+{
+    int i;
+
+    if ( x <= curve->x[0] )
+    {
+        return curve->y[0];
+    }
+    for ( i = 1; i < curve->count; i++ )
+    {
+        if ( x <= curve->x[i] )
+        {
+            return curve->y[i - 1] + (curve->y[i] - curve->y[i - 1]) * (x - curve->x[i - 1]) / (curve->x[i] - curve->x[i - 1]);
+        }
+    }
+    return curve->y[curve->count - 1];
+}
+
+//
+// Either a single number or x:y points with increasing x
+//
+static int curve_parse(curve_t* curve, char* text)
+{
+    char *token, *end, *save = NULL;
+    float x, y;
+
+    curve->count = 0;
+    for ( token = strtok_r(text, " \t", &save); token != NULL; token = strtok_r(NULL, " \t", &save) )
+    {
+        x = strtof(token, &end);
+        if ( end == token )
+        {
+            return -1;
+        }
+        if ( *end == '\0' && curve->count == 0 )
+        {
+            curve_constant(curve, x);
+            return strtok_r(NULL, " \t", &save) == NULL ? 0 : -1;
+        }
+        if ( *end != ':' || curve->count == MODEL_CURVE_POINTS ||
+             (curve->count && x <= curve->x[curve->count - 1]) )
+        {
+            return -1;
+        }
+        token = end + 1;
+        y = strtof(token, &end);
+        if ( end == token || *end != '\0' )
+        {
+            return -1;
+        }
+        curve->x[curve->count] = x;
+        curve->y[curve->count] = y;
+        curve->count++;
+    }
+
+    return curve->count ? 0 : -1;
+}
+
+static int curve_valid(const curve_t* curve, float low, float high)
+{
+    int i;
+
+    for ( i = 0; i < curve->count; i++ )
+    {
+        if ( !(curve->y[i] >= low && curve->y[i] <= high) )
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int profile_load(profile_t* profile, const char* path)
+{
+    char line[MODEL_LINE_LENGTH];
+    char *key, *value, *p;
+    curve_t curve;
+    FILE* fp;
+    int number = 0, retval = 0;
+
+    fp = fopen(path, "r");
+    if ( fp == NULL )
+    {
+        log_error("%s - cannot open %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        return -1;
+    }
+
+    while ( retval == 0 && fgets(line, sizeof (line), fp) != NULL )
+    {
+        number++;
+        if ( (p = strchr(line, '#')) != NULL || (p = strchr(line, '\n')) != NULL )
+        {
+            *p = '\0';
+        }
+        key = strtok_r(line, " \t=", &value);
+        if ( key == NULL )
+        {
+            continue;                                        // blank or comment
+        }
+        value += strspn(value, " \t=");
+
+        if ( curve_parse(&curve, value) == -1 )
+        {
+            retval = -1;
+        }
+        else if ( strcmp(key, "rating") == 0 && curve.count == 1 )
+        {
+            profile->rating = curve.y[0];
+        }
+        else if ( strcmp(key, "capacity") == 0 && curve.count == 1 )
+        {
+            profile->capacity = curve.y[0];
+        }
+        else if ( strcmp(key, "ramp") == 0 && curve.count == 1 )
+        {
+            profile->ramp = curve.y[0];
+        }
+        else if ( strcmp(key, "charge_limit") == 0 )
+        {
+            profile->charge_limit = curve;
+        }
+        else if ( strcmp(key, "discharge_limit") == 0 )
+        {
+            profile->discharge_limit = curve;
+        }
+        else if ( strcmp(key, "charge_efficiency") == 0 )
+        {
+            profile->charge_efficiency = curve;
+        }
+        else if ( strcmp(key, "discharge_efficiency") == 0 )
+        {
+            profile->discharge_efficiency = curve;
+        }
+        else if ( strcmp(key, "efficiency") == 0 && curve.count == 1 )
+        {
+            curve_constant(&profile->charge_efficiency, sqrtf(curve.y[0]));
+            curve_constant(&profile->discharge_efficiency, sqrtf(curve.y[0]));
+        }
+        else
+        {
+            retval = -1;
+        }
+
+        if ( retval == -1 )
+        {
+            log_error("%s - %s:%d: bad or unknown setting %s\n", __PRETTY_FUNCTION__, path, number, key);
+        }
+    }
+    fclose(fp);
+
+    return retval;
+}
+
+//
+// Load a profile, NULL for the original model, and compile it. Called once
+// before the simulation thread starts.
+//
+int model_init(const char* path)
+{
+    profile_t profile;
+    float soc, percent, per_kw;
+    int i;
+
+    profile.rating = 230.0f;
+    profile.capacity = 230.0f * 3000.0f / 3600.0f;
+    profile.ramp = 0.0f;
+    curve_constant(&profile.charge_limit, MODEL_POWER_MAX);
+    curve_constant(&profile.discharge_limit, MODEL_POWER_MAX);
+    curve_constant(&profile.charge_efficiency, 1.0f);
+    curve_constant(&profile.discharge_efficiency, 2800.0f / 3000.0f);
+
+    if ( path != NULL && profile_load(&profile, path) == -1 )
+    {
+        return -1;
+    }
+    if ( !(profile.rating > 0.0f) || !(profile.capacity > 0.0f) || !(profile.ramp >= 0.0f) ||
+         curve_valid(&profile.charge_limit, 0.0f, MODEL_POWER_MAX) == -1 ||
+         curve_valid(&profile.discharge_limit, 0.0f, MODEL_POWER_MAX) == -1 ||
+         curve_valid(&profile.charge_efficiency, 0.01f, 1.0f) == -1 ||
+         curve_valid(&profile.discharge_efficiency, 0.01f, 1.0f) == -1 )
+    {
+        log_error("%s - %s: value out of range\n", __PRETTY_FUNCTION__, path ? path : "default profile");
+        return -1;
+    }
+
+    model.rating = profile.rating;
+    model.ramp = profile.ramp;
+    model.power_scale = MODEL_POWER_STEPS / profile.rating;
+
+    for ( i = 0; i <= MODEL_SOC_STEPS; i++ )
+    {
+        soc = i * 100.0f / MODEL_SOC_STEPS;
+        model.charge_limit[i] = curve_value(&profile.charge_limit, soc);
+        model.discharge_limit[i] = curve_value(&profile.discharge_limit, soc);
+    }
+
+    per_kw = 100.0f / (profile.capacity * 3600.0f);                    // % SoC per kW and second
+    for ( i = 0; i <= MODEL_POWER_STEPS; i++ )
+    {
+        percent = i * 100.0f / MODEL_POWER_STEPS;
+        model.charge_gain[i] = per_kw * curve_value(&profile.charge_efficiency, percent);
+        model.discharge_gain[i] = per_kw / curve_value(&profile.discharge_efficiency, percent);
+    }
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__OPTIMIZE__)   // unoptimised the intrinsics are calls, slower than scalar
+    if ( __builtin_cpu_supports("avx2") )
+    {
+        step_kernel = model_fleet_step_avx2;
+    }
+#endif
+
+    log_info("%s - %s: %.0f kW, %.1f kWh, ramp %.1f kW/s, %s step\n", __PRETTY_FUNCTION__, path ? path : "linear model",
+             profile.rating, profile.capacity, profile.ramp, ( step_kernel == model_fleet_step_scalar ) ? "scalar" : "avx2");
+    return 0;
+}
+
+//
+// Fleet of count units, every lane idle and empty until loaded
+//
+int model_fleet_init(fleet_t* fleet, int count)
+{
+    int lanes = (count + MODEL_LANES - 1) / MODEL_LANES * MODEL_LANES;
+
+    memset(fleet, 0, sizeof (fleet_t));
+    if ( posix_memalign((void**)&fleet->state_of_charge, 64, lanes * sizeof (double)) != 0 ||
+         posix_memalign((void**)&fleet->output, 64, lanes * sizeof (float)) != 0 ||
+         posix_memalign((void**)&fleet->power, 64, lanes * sizeof (float)) != 0 ||
+         posix_memalign((void**)&fleet->mode, 64, lanes) != 0 )
+    {
+        model_fleet_free(fleet);
+        return -1;
+    }
+    memset(fleet->state_of_charge, 0, lanes * sizeof (double));
+    memset(fleet->output, 0, lanes * sizeof (float));
+    memset(fleet->power, 0, lanes * sizeof (float));
+    memset(fleet->mode, 0, lanes);
+    fleet->count = count;
+    return 0;
+}
+
+void model_fleet_free(fleet_t* fleet)
+{
+    free(fleet->state_of_charge);
+    free(fleet->output);
+    free(fleet->power);
+    free(fleet->mode);
+    memset(fleet, 0, sizeof (fleet_t));
+}
+
+//
+// Model state of one battery into its lane, and back out
+//
+void model_fleet_load(fleet_t* fleet, int lane, const battery_t* battery)
+{
+    fleet->state_of_charge[lane] = battery->state_of_charge;
+    fleet->output[lane] = battery->output;
+    fleet->power[lane] = battery->power;
+    fleet->mode[lane] = (battery->battery_charging ? MODEL_CHARGING : 0) |
+                        (battery->battery_discharging ? MODEL_DISCHARGING : 0);
+}
+
+void model_fleet_store(const fleet_t* fleet, int lane, battery_t* battery)
+{
+    battery->state_of_charge = fleet->state_of_charge[lane];
+    battery->output = fleet->output[lane];
+    battery->battery_charging = (fleet->mode[lane] & MODEL_CHARGING) != 0;
+    battery->battery_discharging = (fleet->mode[lane] & MODEL_DISCHARGING) != 0;
+}
+
+//
+// Ramp of a step, no limit when the profile has none
+//
+static float model_ramp(float seconds)
+{
+    float ramp = model.ramp * seconds;
+
+    return ( ramp > 0.0f ) ? ramp : INFINITY;
+}
+
+//
+// Advance every battery by the seconds elapsed since the last step,
+// simulation thread only. The set point is limited by the SoC, the output
+// ramps towards it and the SoC moves by the output scaled by its efficiency.
+// A full or empty battery stops its output.
+//
+void model_fleet_step_scalar(fleet_t* fleet, float seconds)
+{
+    float ramp = model_ramp(seconds);
+    float target, output, delta, power, energy, limit;
+    double soc;
+    int i, index;
+
+    for ( i = 0; i < fleet->count; i++ )
+    {
+        target = fleet->power[i];
+        output = fleet->output[i];
+        soc = fleet->state_of_charge[i];
+
+        index = (int)(soc * (MODEL_SOC_STEPS / 100.0f));
+        limit = -model.charge_limit[index];
+        target = ( target < limit ) ? limit : target;
+        limit = model.discharge_limit[index];
+        target = ( target > limit ) ? limit : target;
+
+        delta = target - output;
+        delta = ( delta > ramp ) ? ramp : delta;
+        delta = ( delta < -ramp ) ? -ramp : delta;
+        output += delta;
+
+        power = fabsf(output);
+        energy = power * seconds;                               // kWs
+        index = (int)(power * model.power_scale + 0.5f);
+        index = ( index > MODEL_POWER_STEPS ) ? MODEL_POWER_STEPS : index;
+
+        if ( output < 0.0f )
+        {
+            soc += energy * model.charge_gain[index];
+            if ( soc >= 100.0 )
+            {
+                soc = 100.0;
+                output = 0.0f;
+            }
+        }
+        else if ( output > 0.0f )
+        {
+            soc -= energy * model.discharge_gain[index];
+            if ( soc <= 0.0 )
+            {
+                soc = 0.0;
+                output = 0.0f;
+            }
+        }
+
+        fleet->state_of_charge[i] = soc;
+        fleet->output[i] = output;
+        fleet->mode[i] = (output < 0.0f ? MODEL_CHARGING : 0) | (output > 0.0f ? MODEL_DISCHARGING : 0);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//
+// Low 32 bits of each 64 bit lane of two vectors, as one vector of eight
+//
+__attribute__((target("avx2")))
+static inline __m256i model_narrow(__m256d lo, __m256d hi)
+{
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    return _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(lo), even),
+                                     _mm256_permutevar8x32_epi32(_mm256_castpd_si256(hi), even), 0x20);
+}
+
+//
+// model_fleet_step_scalar eight units at a time without a branch. The SoC
+// stays double, a vector of eight floats meets two of four doubles. Every
+// choice is a compare and blend taking the same side as the scalar code, the
+// results are bit for bit those of the scalar kernel.
+//
+__attribute__((target("avx2")))
+static void model_fleet_step_avx2(fleet_t* fleet, float seconds)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 ramp = _mm256_set1_ps(model_ramp(seconds));
+    const __m256 ramp_down = _mm256_xor_ps(ramp, sign);
+    const __m256 step = _mm256_set1_ps(seconds);
+    const __m256 scale = _mm256_set1_ps(model.power_scale);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256i steps = _mm256_set1_epi32(MODEL_POWER_STEPS);
+    const __m256d soc_steps = _mm256_set1_pd(MODEL_SOC_STEPS / 100.0f);
+    const __m256d full = _mm256_set1_pd(100.0);
+    const __m256d empty = _mm256_setzero_pd();
+    const __m256i charging_flag = _mm256_set1_epi32(MODEL_CHARGING);
+    const __m256i discharging_flag = _mm256_set1_epi32(MODEL_DISCHARGING);
+    __m256 target, output, limit, delta, power, energy, change, charging, discharging;
+    __m256d soc_lo, soc_hi, stop_lo, stop_hi;
+    __m256i index, mode;
+    __m128i bytes;
+    int i;
+
+    for ( i = 0; i < fleet->count; i += MODEL_LANES )
+    {
+        target = _mm256_load_ps(fleet->power + i);
+        output = _mm256_load_ps(fleet->output + i);
+        soc_lo = _mm256_load_pd(fleet->state_of_charge + i);
+        soc_hi = _mm256_load_pd(fleet->state_of_charge + i + 4);
+
+        index = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_cvttpd_epi32(_mm256_mul_pd(soc_lo, soc_steps))),
+                                        _mm256_cvttpd_epi32(_mm256_mul_pd(soc_hi, soc_steps)), 1);
+        limit = _mm256_xor_ps(_mm256_i32gather_ps(model.charge_limit, index, 4), sign);
+        target = _mm256_blendv_ps(target, limit, _mm256_cmp_ps(target, limit, _CMP_LT_OQ));
+        limit = _mm256_i32gather_ps(model.discharge_limit, index, 4);
+        target = _mm256_blendv_ps(target, limit, _mm256_cmp_ps(target, limit, _CMP_GT_OQ));
+
+        delta = _mm256_sub_ps(target, output);
+        delta = _mm256_blendv_ps(delta, ramp, _mm256_cmp_ps(delta, ramp, _CMP_GT_OQ));
+        delta = _mm256_blendv_ps(delta, ramp_down, _mm256_cmp_ps(delta, ramp_down, _CMP_LT_OQ));
+        output = _mm256_add_ps(output, delta);
+
+        power = _mm256_andnot_ps(sign, output);
+        energy = _mm256_mul_ps(power, step);
+        index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(power, scale), half));
+        index = _mm256_min_epi32(index, steps);
+
+        charging = _mm256_cmp_ps(output, zero, _CMP_LT_OQ);
+        discharging = _mm256_cmp_ps(output, zero, _CMP_GT_OQ);
+        change = _mm256_and_ps(charging, _mm256_mul_ps(energy, _mm256_i32gather_ps(model.charge_gain, index, 4)));
+        change = _mm256_blendv_ps(change, _mm256_xor_ps(_mm256_mul_ps(energy, _mm256_i32gather_ps(model.discharge_gain, index, 4)), sign),
+                                  discharging);
+
+        soc_lo = _mm256_add_pd(soc_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(change)));
+        soc_hi = _mm256_add_pd(soc_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(change, 1)));
+        stop_lo = _mm256_and_pd(_mm256_cmp_pd(soc_lo, full, _CMP_GE_OQ),
+                                _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(_mm256_castps_si256(charging)))));
+        stop_hi = _mm256_and_pd(_mm256_cmp_pd(soc_hi, full, _CMP_GE_OQ),
+                                _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(_mm256_castps_si256(charging), 1))));
+        soc_lo = _mm256_blendv_pd(soc_lo, full, stop_lo);
+        soc_hi = _mm256_blendv_pd(soc_hi, full, stop_hi);
+        output = _mm256_andnot_ps(_mm256_castsi256_ps(model_narrow(stop_lo, stop_hi)), output);
+
+        stop_lo = _mm256_and_pd(_mm256_cmp_pd(soc_lo, empty, _CMP_LE_OQ),
+                                _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(_mm256_castps_si256(discharging)))));
+        stop_hi = _mm256_and_pd(_mm256_cmp_pd(soc_hi, empty, _CMP_LE_OQ),
+                                _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(_mm256_castps_si256(discharging), 1))));
+        soc_lo = _mm256_blendv_pd(soc_lo, empty, stop_lo);
+        soc_hi = _mm256_blendv_pd(soc_hi, empty, stop_hi);
+        output = _mm256_andnot_ps(_mm256_castsi256_ps(model_narrow(stop_lo, stop_hi)), output);
+
+        mode = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(output, zero, _CMP_LT_OQ)), charging_flag),
+                               _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(output, zero, _CMP_GT_OQ)), discharging_flag));
+        bytes = _mm_packs_epi32(_mm256_castsi256_si128(mode), _mm256_extracti128_si256(mode, 1));
+        _mm_storel_epi64((__m128i*)(fleet->mode + i), _mm_packus_epi16(bytes, bytes));
+
+        _mm256_store_pd(fleet->state_of_charge + i, soc_lo);
+        _mm256_store_pd(fleet->state_of_charge + i + 4, soc_hi);
+        _mm256_store_ps(fleet->output + i, output);
+    }
+}
+#endif
+
+void model_fleet_step(fleet_t* fleet, float seconds)
+{
+    step_kernel(fleet, seconds);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the table driven battery model. A profile describes the
+ * battery, model_init compiles it into lookup tables so that a step costs a
+ * couple of table lookups per unit whatever the curves look like. Steps
+ * integrate over the elapsed time, whatever the tick length. The whole fleet
+ * is stepped at once, with AVX2 where the CPU has it.
+ */
+#ifndef MODEL_DOT_H
+#define MODEL_DOT_H
+
+#include <stdint.h>
+#include "typedefs.h"
+
+#define MODEL_SOC_STEPS          1000                // limit tables, 0.1% of SoC per entry
+#define MODEL_POWER_STEPS        256                 // gain tables, fraction of the rating per entry
+#define MODEL_CURVE_POINTS       16                  // most points of a profile curve
+#define MODEL_POWER_MAX          32768.0f            // set point range of directPower, kW
+#define MODEL_LANES              8                   // units per step of the vector kernel, fleets are padded to it
+
+#define MODEL_CHARGING           1                   // fleet mode flags
+#define MODEL_DISCHARGING        2
+
+//
+// Lookup tables compiled from a profile
+//
+typedef struct model_struct
+{
+    float rating;                                    // kW, range of the gain tables
+    float ramp;                                      // kW per second, 0 follows the set point at once
+    float power_scale;                               // kW to gain table index
+    float charge_limit[MODEL_SOC_STEPS + 1];         // kW by SoC
+    float discharge_limit[MODEL_SOC_STEPS + 1];      // kW by SoC
+    float charge_gain[MODEL_POWER_STEPS + 1];        // % SoC gained per kW and second, efficiency included
+    float discharge_gain[MODEL_POWER_STEPS + 1];     // % SoC lost per kW and second, efficiency included
+}model_t;
+
+//
+// Model state of every battery, an array per field so that a step streams
+// through memory a vector of units at a time. Lane i is unit i, the arrays
+// are 64 byte aligned and padded with idle lanes to MODEL_LANES.
+//
+typedef struct fleet_struct
+{
+    int      count;                                  // units
+    double*  state_of_charge;                        // percent
+    float*   output;                                 // kW, negative charges
+    float*   power;                                  // set point kW, negative charges
+    uint8_t* mode;                                   // MODEL_CHARGING, MODEL_DISCHARGING or 0
+}fleet_t;
+
+int  model_init(const char* profile);
+int  model_fleet_init(fleet_t* fleet, int count);
+void model_fleet_free(fleet_t* fleet);
+void model_fleet_load(fleet_t* fleet, int lane, const battery_t* battery);
+void model_fleet_store(const fleet_t* fleet, int lane, battery_t* battery);
+void model_fleet_step(fleet_t* fleet, float seconds);
+void model_fleet_step_scalar(fleet_t* fleet, float seconds);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Lock-free single producer, single consumer command queue. Each worker
+ * pushes the set point changes of its units into a queue of its own, the
+ * simulation thread pops and applies them at tick boundaries.
+ */
+#ifndef QUEUE_DOT_H
+#define QUEUE_DOT_H
+
+#include <stdint.h>
+#include "typedefs.h"
+
+#define COMMAND_QUEUE_SIZE    4096                   // commands, power of two
+
+typedef struct command_queue_struct
+{
+    uint32_t  head __attribute__((aligned(64)));     // written by the producer only
+    uint32_t  tail __attribute__((aligned(64)));     // written by the consumer only
+    command_t ring[COMMAND_QUEUE_SIZE] __attribute__((aligned(64)));
+}command_queue_t;
+
+//
+// Returns -1 when the queue is full
+//
+static inline int command_push(command_queue_t* q, const command_t* command)
+{
+    uint32_t head = q->head;
+
+    if ( head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == COMMAND_QUEUE_SIZE )
+    {
+        return -1;
+    }
+    q->ring[head & (COMMAND_QUEUE_SIZE - 1)] = *command;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//
+// Returns -1 when the queue is empty
+//
+static inline int command_pop(command_queue_t* q, command_t* command)
+{
+    uint32_t tail = q->tail;
+
+    if ( tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) )
+    {
+        return -1;
+    }
+    *command = q->ring[tail & (COMMAND_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif
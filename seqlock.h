@@ -0,0 +1,47 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Sequence lock for state published by a single writer. Readers never block
+ * the writer and retry if they raced with an update, so a reader always sees
+ * a consistent copy.
+ */
+#ifndef SEQLOCK_DOT_H
+#define SEQLOCK_DOT_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()    __builtin_ia32_pause()
+#else
+#define cpu_relax()    __asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline void seqlock_write_begin(uint32_t* sequence)
+{
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);     // odd, update in progress
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t* sequence)
+{
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);     // even, update complete
+}
+
+static inline uint32_t seqlock_read_begin(const uint32_t* sequence)
+{
+    uint32_t s;
+
+    while ( (s = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1 )
+    {
+        cpu_relax();
+    }
+    return s;
+}
+
+static inline int seqlock_read_retry(const uint32_t* sequence, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(sequence, __ATOMIC_RELAXED) != s;
+}
+
+#endif
@@ -0,0 +1,1050 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Event driven modbus tcp server. Every worker thread runs its own epoll
+ * loop on its own SO_REUSEPORT listener, the kernel spreads new connections
+ * over the workers. Each connection keeps its own receive buffer and complete
+ * MBAP frames are handed to process_query. Pipelined requests are processed
+ * in order and their replies go out together in a single send.
+ *
+ * The units are sharded over the workers, only the owner of a unit runs its
+ * frames. A connection addressing a unit of another worker is handed over to
+ * that worker with its buffers, so a client polling one battery ends up on
+ * the worker owning it and the hot path shares nothing with other workers.
+ *
+ * In UDP mode every datagram carries one MBAP frame and gets its reply back
+ * to the address it came from. There is no per peer state, datagrams are
+ * received and answered in batches with recvmmsg and sendmmsg, and a socket
+ * filter makes the kernel deliver each one to the worker owning its unit.
+ *
+ * Replies fault injection holds back wait on the timer wheel of the worker,
+ * every other client and the simulation carry on meanwhile. A connection's
+ * held back replies go with it when it is handed over and are dropped when
+ * it closes. The reply to a simulationStep write waits on the wheel as well,
+ * checked every ms until the simulation has caught up, and the connection's
+ * next frames are only processed once it has gone out.
+ */
+#define _GNU_SOURCE                                          // accept4, pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <modbus/modbus.h>
+#include "server.h"
+#include "tesla.h"
+#include "typedefs.h"
+#include "log.h"
+#include "checkpoint.h"
+#include "capture.h"
+#include "stats.h"
+#include "fault.h"
+#include "wheel.h"
+#include "trace.h"
+#include "simclock.h"
+
+#define SERVER_MAX_EVENTS        64
+#define MBAP_LENGTH_MIN          2                                 // unit id + function code
+#define MBAP_LENGTH_MAX          (MODBUS_TCP_MAX_ADU_LENGTH - 6)   // adu - tid - pid - len
+#define MBAP_UNIT_OFFSET         6                                 // unit id within the frame
+
+//
+// Datagrams taken in by one recvmmsg and the replies sent back by one sendmmsg
+//
+typedef struct datagram_batch_struct
+{
+    struct mmsghdr     received[SERVER_DATAGRAM_BATCH];
+    struct mmsghdr     replies[SERVER_DATAGRAM_BATCH];
+    struct iovec       query_iov[SERVER_DATAGRAM_BATCH];
+    struct iovec       reply_iov[SERVER_DATAGRAM_BATCH];
+    struct sockaddr_in peer[SERVER_DATAGRAM_BATCH];
+    uint8_t            query[SERVER_DATAGRAM_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+    uint8_t            reply[SERVER_DATAGRAM_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+}datagram_batch_t;
+
+//
+// Reply held back by fault injection until its timer fires, for a connection
+// or for the peer of a datagram
+//
+typedef struct deferred_struct
+{
+    wheel_timer_t timer;                                           // first, the wheel hands it back
+    struct deferred_struct* next;                                  // connection's list or free list
+    struct deferred_struct* prev;
+    connection_t* conn;                                            // NULL for a datagram
+    bool          stepping;                                        // waits for the simulation to catch up too
+    struct sockaddr_in peer;
+    socklen_t     peer_length;
+    int           length;
+    uint8_t       reply[MODBUS_TCP_MAX_ADU_LENGTH];
+}deferred_t;
+
+typedef struct worker_struct
+{
+    int           id;                                              // also the shard it serves
+    int           cpu;                                             // -1 when not pinned
+    int           listen_socket;
+    int           epoll_fd;
+    int           wakeup_fd;                                       // eventfd, handovers and stop
+    datagram_batch_t* batch;                                       // UDP mode only
+    connection_t* free_connections;                                // closed connections kept for reuse
+    connection_t* handed_over;                                     // waiting to be adopted, under lock
+    deferred_t*   free_deferred;                                   // released held back replies
+    wheel_t       wheel;                                           // held back replies, ms ticks
+    pthread_mutex_t lock;
+    pthread_t     thread;
+}__attribute__((aligned(64))) worker_t;
+
+// Private data
+static worker_t workers[SERVER_WORKERS_MAX];
+static int worker_count = 0;
+static bool udp = false;
+static __thread worker_t* worker;                                  // worker of the calling thread
+static int connections = 0;                                        // over all workers
+static int max_connections = SERVER_MAX_CONNECTIONS_DEFAULT;
+static volatile sig_atomic_t stopping = 0;
+
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// While replies are waiting for the socket to drain input is not read, a
+// client that stops reading cannot make the server buffer without limit.
+// Neither is it while a simulationStep reply is held back.
+//
+static int server_watch(connection_t* conn, bool writing, bool stepping)
+{
+    struct epoll_event ev;
+
+    if ( conn->writing == writing && conn->stepping == stepping )
+    {
+        return 0;
+    }
+    conn->writing = writing;
+    conn->stepping = stepping;
+    ev.events = ( writing ? EPOLLOUT : stepping ? 0 : EPOLLIN ) | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    return epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+//
+// Send the replies built so far, whatever the socket does not take is kept
+// for EPOLLOUT. Returns -1 when the connection has to be closed.
+//
+static int server_flush(connection_t* conn)
+{
+    uint64_t start;
+    ssize_t rc;
+
+    if ( conn->reply_length == 0 )
+    {
+        return server_watch(conn, false, conn->stepping);
+    }
+
+    start = trace_begin();
+    rc = send(conn->fd, conn->reply, conn->reply_length, MSG_NOSIGNAL);
+    trace_end(TRACE_SEND, start, 0, ( rc > 0 ) ? rc : 0);
+    if ( rc == -1 )
+    {
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        {
+            return -1;
+        }
+        rc = 0;
+    }
+
+    conn->reply_length -= rc;
+    if ( conn->reply_length && rc )
+    {
+        memmove(conn->reply, conn->reply + rc, conn->reply_length);
+    }
+
+    return server_watch(conn, conn->reply_length != 0, conn->stepping);
+}
+
+//
+// Put a held back reply on the free list, off its connection's list
+//
+static void server_release(deferred_t* d)
+{
+    if ( d->conn != NULL )
+    {
+        if ( d->prev != NULL )
+        {
+            d->prev->next = d->next;
+        }
+        else
+        {
+            d->conn->deferred = d->next;
+        }
+        if ( d->next != NULL )
+        {
+            d->next->prev = d->prev;
+        }
+    }
+    d->next = worker->free_deferred;
+    worker->free_deferred = d;
+}
+
+//
+// Hold a reply back for fault_delay ms, and until a simulationStep it
+// acknowledges is done. conn is NULL for a datagram to peer. Returns the
+// length still to send now, 0 once the reply is held back.
+//
+static int server_hold(connection_t* conn, const struct sockaddr_in* peer, socklen_t peer_length,
+                       const uint8_t* reply, int length)
+{
+    uint32_t delay = fault_delay;
+    bool stepping = query_stepped;
+    uint64_t now;
+    deferred_t* d;
+
+    if ( delay == 0 && !stepping )
+    {
+        return length;
+    }
+    fault_delay = 0;
+    query_stepped = false;
+    if ( worker->wheel.count >= SERVER_DEFERRED_MAX && !stepping )
+    {
+        log_debug("%s - %d replies held back already, sent at once\n", __PRETTY_FUNCTION__, SERVER_DEFERRED_MAX);
+        return length;
+    }
+
+    d = worker->free_deferred;
+    if ( d != NULL )
+    {
+        worker->free_deferred = d->next;
+    }
+    else if ( (d = malloc(sizeof (deferred_t))) == NULL )
+    {
+        return length;
+    }
+    d->conn = conn;
+    d->stepping = stepping;
+    d->prev = d->next = NULL;
+    if ( conn != NULL )
+    {
+        d->next = conn->deferred;
+        if ( d->next != NULL )
+        {
+            d->next->prev = d;
+        }
+        conn->deferred = d;
+        if ( stepping )
+        {
+            server_watch(conn, conn->writing, true);
+        }
+    }
+    else
+    {
+        d->peer = *peer;
+        d->peer_length = peer_length;
+    }
+    d->length = length;
+    memcpy(d->reply, reply, length);
+
+    now = monotonic_ns() / 1000000;
+    wheel_sync(&worker->wheel, now);
+    wheel_add(&worker->wheel, &d->timer, now + ( delay ? delay : 1 ));
+    return 0;
+}
+
+static void server_close(connection_t* conn)
+{
+    while ( conn->deferred != NULL )
+    {
+        wheel_del(&worker->wheel, &conn->deferred->timer);
+        server_release(conn->deferred);
+    }
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->next = worker->free_connections;
+    worker->free_connections = conn;
+    stats_add(&stats->connections, -1);
+    log_info("%s - client disconnected (%d connected)\n", __PRETTY_FUNCTION__,
+             __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED));
+}
+
+//
+// Take a connection from the free list, only the first use of a slot allocates
+//
+static connection_t* server_connection(int fd)
+{
+    connection_t* conn = worker->free_connections;
+
+    if ( conn != NULL )
+    {
+        worker->free_connections = conn->next;
+    }
+    else
+    {
+        conn = malloc(sizeof (connection_t));
+        if ( conn == NULL )
+        {
+            return NULL;
+        }
+    }
+    conn->next = NULL;
+    conn->fd = fd;
+    conn->length = 0;
+    conn->reply_length = 0;
+    conn->writing = false;
+    conn->stepping = false;
+    conn->deferred = NULL;
+    return conn;
+}
+
+//
+// Accept every pending connection on the worker's listen socket. The listener
+// and the simulation outlive every client, a reconnect only costs the accept.
+//
+static void server_accept(void)
+{
+    struct epoll_event ev;
+    connection_t* conn;
+    int fd, count, nodelay = 1;
+
+    for (;;)
+    {
+        fd = accept4(worker->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( fd == -1 )
+        {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            {
+                log_error("%s - accept failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+            }
+            break;
+        }
+
+        count = __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+        if ( count > max_connections )
+        {
+            log_warn("%s - connection limit (%d) reached\n", __PRETTY_FUNCTION__, max_connections);
+            __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+            close(fd);
+            continue;
+        }
+
+        conn = server_connection(fd);
+        if ( conn == NULL )
+        {
+            __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));   // replies are complete frames
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if ( epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 )
+        {
+            __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+            close(fd);
+            conn->next = worker->free_connections;
+            worker->free_connections = conn;
+            continue;
+        }
+        stats_add(&stats->connections, 1);
+        stats_add(&stats->accepted, 1);
+        log_info("%s - worker %d, client connected (%d connected)\n", __PRETTY_FUNCTION__, worker->id, count);
+    }
+}
+
+//
+// Worker owning the unit a frame is addressed to. Frames for unknown units
+// only get an exception and are answered wherever they arrive.
+//
+static worker_t* server_owner(uint8_t unit_id)
+{
+    unit_t* unit;
+
+    if ( worker_count == 1 || (unit = unit_lookup(unit_id)) == NULL )
+    {
+        return worker;
+    }
+    return &workers[unit_shard(unit)];
+}
+
+static int server_wake(worker_t* w)
+{
+    uint64_t one = 1;
+
+    return write(w->wakeup_fd, &one, sizeof (one)) == -1 ? -1 : 0;
+}
+
+//
+// Pass a connection on to the worker owning the unit of its next frame, with
+// the frames and replies it still holds. The new owner picks it up from its
+// wake up event, nothing is touched here afterwards.
+//
+static void server_hand_over(connection_t* conn, worker_t* owner)
+{
+    deferred_t* d;
+
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    for ( d = conn->deferred; d != NULL; d = d->next )
+    {
+        wheel_del(&worker->wheel, &d->timer);                        // the new owner times them
+    }
+    stats_add(&stats->handovers, 1);
+    log_trace("%s - connection %d, worker %d to %d\n", __PRETTY_FUNCTION__, conn->fd, worker->id, owner->id);
+
+    pthread_mutex_lock(&owner->lock);
+    conn->next = owner->handed_over;
+    owner->handed_over = conn;
+    pthread_mutex_unlock(&owner->lock);
+    if ( server_wake(owner) == -1 )
+    {
+        log_error("%s - wake up worker %d failed: %s\n", __PRETTY_FUNCTION__, owner->id, strerror(errno));
+    }
+}
+
+//
+// Process every complete MBAP frame held in the connection buffer, replies are
+// collected and sent once the batch is done. Returns -1 when the connection
+// has to be closed and 1 when it went to another worker.
+//
+static int server_batch_process(connection_t* conn)
+{
+    const uint16_t header_length = sizeof (mbap_header_t) - 1;       // tid + pid + len
+    mbap_header_t* mbap;
+    worker_t* owner = worker;
+    uint8_t* p;
+    uint16_t length, frame_length;
+    int remaining, reply_length;
+
+    p = conn->query;
+    remaining = conn->length;
+    while ( !conn->stepping && remaining >= (int)sizeof (mbap_header_t) )
+    {
+        mbap = (mbap_header_t*)p;
+        length = __bswap_16(mbap->length);
+        if ( mbap->protocol_id != 0 || length < MBAP_LENGTH_MIN || length > MBAP_LENGTH_MAX )
+        {
+            log_warn("%s - malformed MBAP header, dropping client\n", __PRETTY_FUNCTION__);
+            return -1;
+        }
+
+        frame_length = header_length + length;
+        if ( remaining < frame_length )
+        {
+            break;                                                   // wait for rest of frame
+        }
+
+        owner = server_owner(mbap->unit_id);
+        if ( owner != worker )
+        {
+            break;
+        }
+
+        if ( REPLY_BUFFER_SIZE - conn->reply_length < MODBUS_TCP_MAX_ADU_LENGTH )
+        {
+            if ( server_flush(conn) == -1 )
+            {
+                return -1;
+            }
+            if ( conn->writing )
+            {
+                break;                                               // resume on EPOLLOUT
+            }
+        }
+
+        reply_length = process_query((modbus_pdu_t*)p, conn->reply + conn->reply_length);
+        capture_frame(conn->fd, p, frame_length, conn->reply + conn->reply_length, reply_length);
+        conn->reply_length += server_hold(conn, NULL, 0, conn->reply + conn->reply_length, reply_length);
+        p += frame_length;
+        remaining -= frame_length;
+    }
+
+    if ( remaining && p != conn->query )
+    {
+        memmove(conn->query, p, remaining);
+    }
+    conn->length = remaining;
+
+    if ( owner != worker )
+    {
+        server_hand_over(conn, owner);
+        return 1;
+    }
+    return server_flush(conn);
+}
+
+//
+// Time every batch, from its frames being processed until their replies are
+// handed to the socket
+//
+static int server_process(connection_t* conn)
+{
+    uint64_t start = monotonic_ns(), frames = stats->frames;
+    int retval;
+
+    retval = server_batch_process(conn);
+    stats_latency(monotonic_ns() - start, stats->frames - frames);
+    return retval;
+}
+
+//
+// Read whatever is available and process it. Returns -1 when the connection
+// has to be closed.
+//
+static int server_read(connection_t* conn)
+{
+    uint64_t start = trace_begin();
+    ssize_t rc;
+
+    rc = read(conn->fd, conn->query + conn->length, sizeof (conn->query) - conn->length);
+    trace_end(TRACE_RECEIVE, start, 0, ( rc > 0 ) ? rc : 0);
+    if ( rc == 0 )
+    {
+        return -1;
+    }
+    else if ( rc == -1 )
+    {
+        return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+    }
+    conn->length += rc;
+
+    return server_process(conn);
+}
+
+//
+// Socket drained enough to take more replies, finish the batch that was
+// waiting on it
+//
+static int server_write(connection_t* conn)
+{
+    if ( server_flush(conn) == -1 )
+    {
+        return -1;
+    }
+    return conn->writing ? 0 : server_process(conn);
+}
+
+//
+// Held back reply due, queued behind the replies of its connection or sent
+// to the peer of its datagram. A simulationStep reply is checked again a ms
+// later while the simulation is still stepping, once out its connection's
+// next frames are processed.
+//
+static void server_expire(wheel_timer_t* timer)
+{
+    deferred_t* d = (deferred_t*)timer;
+    connection_t* conn = d->conn;
+    bool stepping;
+
+    if ( d->stepping && !simclock_caught_up() )
+    {
+        wheel_add(&worker->wheel, timer, worker->wheel.now);
+        return;
+    }
+    if ( conn == NULL )
+    {
+        if ( sendto(worker->listen_socket, d->reply, d->length, MSG_DONTWAIT,
+                    (struct sockaddr*)&d->peer, d->peer_length) == -1 )
+        {
+            log_debug("%s - held back reply dropped: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        }
+        server_release(d);
+        return;
+    }
+
+    if ( REPLY_BUFFER_SIZE - conn->reply_length < d->length )
+    {
+        wheel_add(&worker->wheel, timer, worker->wheel.now);        // once the socket has drained
+        return;
+    }
+    memcpy(conn->reply + conn->reply_length, d->reply, d->length);
+    conn->reply_length += d->length;
+    stepping = d->stepping;
+    server_release(d);
+    if ( (stepping && server_watch(conn, conn->writing, false) == -1) || server_write(conn) == -1 )
+    {
+        server_close(conn);
+    }
+}
+
+//
+// Wait for the next checkpoint of the worker's shard or held back reply
+//
+static int server_timeout(void)
+{
+    int checkpoint = checkpoint_timeout(worker->id), wheel;
+
+    if ( worker->wheel.count == 0 )
+    {
+        return checkpoint;
+    }
+    wheel = wheel_timeout(&worker->wheel, monotonic_ns() / 1000000);
+    return ( checkpoint == -1 || wheel < checkpoint ) ? wheel : checkpoint;
+}
+
+//
+// Check one datagram holds exactly one MBAP frame and build its reply.
+// Returns the reply length, 0 when fault injection drops the reply and -1
+// when the datagram is dropped unprocessed.
+//
+static int server_datagram(uint8_t* query, int length, int flags, uint8_t* reply)
+{
+    mbap_header_t* mbap = (mbap_header_t*)query;
+    uint16_t mbap_length;
+
+    if ( (flags & MSG_TRUNC) || length < (int)sizeof (mbap_header_t) + 1 )
+    {
+        return -1;
+    }
+    mbap_length = __bswap_16(mbap->length);
+    if ( mbap->protocol_id != 0 || mbap_length < MBAP_LENGTH_MIN || mbap_length > MBAP_LENGTH_MAX ||
+         length != (int)sizeof (mbap_header_t) - 1 + mbap_length )
+    {
+        log_debug("%s - malformed datagram of %d bytes dropped\n", __PRETTY_FUNCTION__, length);
+        return -1;
+    }
+    if ( server_owner(mbap->unit_id) != worker )
+    {
+        return -1;                                                   // came in before the filter was set
+    }
+
+    return process_query((modbus_pdu_t*)query, reply);
+}
+
+//
+// Answer every datagram waiting on the worker's socket, a batch at a time.
+// Replies the socket cannot take are dropped, as the network may drop them.
+//
+static void server_receive(void)
+{
+    datagram_batch_t* b = worker->batch;
+    struct mmsghdr* reply;
+    uint64_t start, frames, traced;
+    int i, n, count, length, sent;
+
+    do
+    {
+        for ( i = 0; i < SERVER_DATAGRAM_BATCH; i++ )
+        {
+            b->received[i].msg_hdr.msg_namelen = sizeof (b->peer[i]);
+        }
+        traced = trace_begin();
+        n = recvmmsg(worker->listen_socket, b->received, SERVER_DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+        trace_end(TRACE_RECEIVE, traced, 0, ( n > 0 ) ? n : 0);
+        if ( n == -1 )
+        {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            {
+                log_error("%s - recvmmsg failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+            }
+            return;
+        }
+
+        start = monotonic_ns();
+        frames = stats->frames;
+        for ( i = 0, count = 0; i < n; i++ )
+        {
+            reply = &b->replies[count];
+            length = server_datagram(b->query[i], b->received[i].msg_len, b->received[i].msg_hdr.msg_flags,
+                                     b->reply[count]);
+            if ( length == -1 )
+            {
+                continue;
+            }
+            capture_frame(ntohs(b->peer[i].sin_port), b->query[i], b->received[i].msg_len, b->reply[count], length);
+            if ( server_hold(NULL, &b->peer[i], b->received[i].msg_hdr.msg_namelen, b->reply[count], length) == 0 )
+            {
+                continue;                                            // dropped or held back
+            }
+            reply->msg_hdr.msg_name = &b->peer[i];
+            reply->msg_hdr.msg_namelen = b->received[i].msg_hdr.msg_namelen;
+            b->reply_iov[count].iov_len = length;
+            count++;
+        }
+
+        traced = trace_begin();
+        sent = count ? sendmmsg(worker->listen_socket, b->replies, count, MSG_DONTWAIT) : 0;
+        trace_end(TRACE_SEND, traced, 0, ( sent > 0 ) ? sent : 0);
+        if ( sent < count )
+        {
+            log_debug("%s - %d replies dropped\n", __PRETTY_FUNCTION__, count - (sent == -1 ? 0 : sent));
+        }
+        stats_latency(monotonic_ns() - start, stats->frames - frames);
+    } while ( n == SERVER_DATAGRAM_BATCH );
+}
+
+static datagram_batch_t* server_batch(void)
+{
+    datagram_batch_t* b = calloc(1, sizeof (datagram_batch_t));
+    int i;
+
+    for ( i = 0; b != NULL && i < SERVER_DATAGRAM_BATCH; i++ )
+    {
+        b->query_iov[i].iov_base = b->query[i];
+        b->query_iov[i].iov_len = sizeof (b->query[i]);
+        b->received[i].msg_hdr.msg_name = &b->peer[i];
+        b->received[i].msg_hdr.msg_iov = &b->query_iov[i];
+        b->received[i].msg_hdr.msg_iovlen = 1;
+        b->reply_iov[i].iov_base = b->reply[i];
+        b->replies[i].msg_hdr.msg_iov = &b->reply_iov[i];
+        b->replies[i].msg_hdr.msg_iovlen = 1;
+    }
+    return b;
+}
+
+//
+// Have the kernel deliver every datagram to the worker owning its unit, the
+// sockets of a SO_REUSEPORT group are numbered in the order they were bound.
+// Units go round robin unless a single battery answers every unit id.
+//
+static int server_steer(void)
+{
+    struct sock_filter by_unit[] =
+    {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, MBAP_UNIT_OFFSET),       // datagram payload
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, worker_count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_filter first[] =
+    {
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog program = { sizeof (by_unit) / sizeof (by_unit[0]), by_unit };
+    unit_t* unit;
+    int id;
+
+    for ( id = 1; id <= UNITS_MAX; id++ )
+    {
+        unit = unit_lookup(id);
+        if ( unit != NULL && unit_shard(unit) != (id - 1) % worker_count )
+        {
+            program.len = 1;
+            program.filter = first;
+            break;
+        }
+    }
+
+    return setsockopt(workers[0].listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof (program));
+}
+
+//
+// Take in the connections other workers handed over, they carry on where
+// they stopped: replies still to send first, then the frames left
+//
+static void server_adopt(void)
+{
+    struct epoll_event ev;
+    connection_t *conn, *next;
+    deferred_t* d;
+    uint64_t count, start = trace_begin();
+    int adopted = 0;
+
+    if ( read(worker->wakeup_fd, &count, sizeof (count)) == -1 )
+    {
+        return;
+    }
+    pthread_mutex_lock(&worker->lock);
+    conn = worker->handed_over;
+    worker->handed_over = NULL;
+    pthread_mutex_unlock(&worker->lock);
+
+    for ( ; conn != NULL; conn = next, adopted++ )
+    {
+        next = conn->next;
+        conn->next = NULL;
+        if ( conn->deferred != NULL )
+        {
+            wheel_sync(&worker->wheel, monotonic_ns() / 1000000);
+        }
+        for ( d = conn->deferred; d != NULL; d = d->next )
+        {
+            wheel_add(&worker->wheel, &d->timer, d->timer.expires);
+        }
+        ev.events = ( conn->writing ? EPOLLOUT : EPOLLIN ) | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if ( epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1 ||
+             (!conn->writing && server_process(conn) == -1) )
+        {
+            server_close(conn);
+        }
+    }
+    trace_end(TRACE_ADOPT, start, 0, adopted);
+}
+
+//
+// Listen socket of one worker, every worker binds the same port. In UDP mode
+// it receives the datagrams.
+//
+static int server_listen(int port, bool shared)
+{
+    struct sockaddr_in addr;
+    int fd, enable = 1;
+
+    fd = socket(AF_INET, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( fd == -1 )
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable)) == -1 ||
+         (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof (enable)) == -1) ||
+         bind(fd, (struct sockaddr*)&addr, sizeof (addr)) == -1 ||
+         (!udp && listen(fd, SERVER_LISTEN_BACKLOG) == -1) )
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int server_worker_init(worker_t* w, int port, bool shared)
+{
+    struct epoll_event ev;
+
+    w->listen_socket = server_listen(port, shared);
+    if ( w->listen_socket == -1 )
+    {
+        log_error("%s - worker %d cannot listen on port %d: %s\n", __PRETTY_FUNCTION__, w->id, port, strerror(errno));
+        return -1;
+    }
+
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    w->batch = udp ? server_batch() : NULL;
+    w->free_deferred = NULL;
+    wheel_init(&w->wheel, monotonic_ns() / 1000000);
+    if ( w->epoll_fd == -1 || w->wakeup_fd == -1 || (udp && w->batch == NULL) )
+    {
+        log_error("%s - worker %d: %s\n", __PRETTY_FUNCTION__, w->id, strerror(errno));
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;                                              // NULL marks the listen socket
+    if ( epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_socket, &ev) == -1 )
+    {
+        log_error("%s - failed to register listen socket: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+    ev.data.ptr = w;                                                 // the worker marks its wake up event
+    if ( epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wakeup_fd, &ev) == -1 )
+    {
+        log_error("%s - failed to register wake up event: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Set up count workers listening on port, for datagrams in UDP mode. Worker i
+// is pinned to cpus[i] taken round robin, cpu_count 0 leaves the scheduler to
+// place them.
+//
+int server_init(int port, int count, const int* cpus, int cpu_count, int max, bool datagrams)
+{
+    int i;
+
+    max_connections = max;
+    udp = datagrams;
+
+    for ( i = 0; i < count; i++ )
+    {
+        worker_t* w = &workers[i];
+
+        w->id = i;
+        w->cpu = cpu_count ? cpus[i % cpu_count] : -1;
+        w->listen_socket = w->epoll_fd = w->wakeup_fd = -1;
+        w->free_connections = w->handed_over = NULL;
+        pthread_mutex_init(&w->lock, NULL);
+        worker_count = i + 1;                                        // server_stop wakes it from now on
+        if ( server_worker_init(w, port, count > 1) == -1 )
+        {
+            return -1;
+        }
+    }
+
+    if ( udp && worker_count > 1 && server_steer() == -1 )
+    {
+        log_error("%s - cannot steer datagrams to their workers: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+        return -1;
+    }
+
+    log_info("%s - %d worker%s on %s port %d\n", __PRETTY_FUNCTION__, worker_count, worker_count > 1 ? "s" : "",
+             udp ? "udp" : "tcp", port);
+    return 0;
+}
+
+//
+// Async signal safe, server_run returns once every worker is done with its
+// current batch
+//
+void server_stop(void)
+{
+    int i;
+
+    stopping = 1;
+    for ( i = 0; i < worker_count; i++ )
+    {
+        server_wake(&workers[i]);
+    }
+}
+
+//
+// Event loop of the calling worker, returns 0 after server_stop and -1 on a
+// fatal error, which stops every other worker too. Each worker writes the
+// checkpoint of its own shard as the register images belong to it.
+//
+static int server_loop(worker_t* self)
+{
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    connection_t* conn;
+    char name[TRACE_NAME_LENGTH];
+    cpu_set_t set;
+    int i, n;
+
+    worker = self;
+    stats_attach();
+    snprintf(name, sizeof (name), "worker %d", worker->id);
+    trace_attach(name);
+    if ( worker->cpu != -1 )
+    {
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if ( worker->cpu >= CPU_SETSIZE || pthread_setaffinity_np(pthread_self(), sizeof (set), &set) != 0 )
+        {
+            log_warn("%s - cannot pin worker %d to cpu %d\n", __PRETTY_FUNCTION__, worker->id, worker->cpu);
+        }
+    }
+
+    while ( !stopping )
+    {
+        n = epoll_wait(worker->epoll_fd, events, SERVER_MAX_EVENTS, server_timeout());
+        if ( n == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            log_error("%s - worker %d epoll_wait failed: %s\n", __PRETTY_FUNCTION__, worker->id, strerror(errno));
+            server_stop();
+            return -1;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            conn = events[i].data.ptr;
+            if ( conn == NULL )
+            {
+                if ( udp )
+                {
+                    server_receive();
+                }
+                else
+                {
+                    server_accept();
+                }
+                continue;
+            }
+            if ( events[i].data.ptr == worker )
+            {
+                server_adopt();
+                continue;
+            }
+
+            if ( events[i].events & (EPOLLERR | EPOLLHUP) )
+            {
+                server_close(conn);
+            }
+            else if ( events[i].events & EPOLLOUT )
+            {
+                if ( server_write(conn) == -1 )
+                {
+                    server_close(conn);
+                }
+            }
+            else if ( server_read(conn) == -1 )
+            {
+                server_close(conn);
+            }
+        }
+
+        if ( worker->wheel.count != 0 )
+        {
+            wheel_advance(&worker->wheel, monotonic_ns() / 1000000, server_expire);
+        }
+        if ( checkpoint_due(worker->id) )
+        {
+            tesla_checkpoint(worker->id);
+        }
+    }
+
+    return 0;
+}
+
+static void* server_thread(void* ptr)
+{
+    return (void*)(intptr_t)server_loop(ptr);
+}
+
+//
+// Runs worker 0 on the calling thread and the others on threads of their
+// own, returns once all of them are done. Signals are left to the caller.
+//
+int server_run(void)
+{
+    sigset_t all, previous;
+    void* result;
+    int i, retval = 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    for ( i = 1; i < worker_count; i++ )
+    {
+        if ( pthread_create(&workers[i].thread, NULL, server_thread, &workers[i]) != 0 )
+        {
+            log_error("%s - cannot start worker %d\n", __PRETTY_FUNCTION__, i);
+            worker_count = i;
+            server_stop();
+            retval = -1;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if ( server_loop(&workers[0]) == -1 )
+    {
+        retval = -1;
+    }
+    for ( i = 1; i < worker_count; i++ )
+    {
+        pthread_join(workers[i].thread, &result);
+        if ( result != NULL )
+        {
+            retval = -1;
+        }
+    }
+
+    return retval;
+}
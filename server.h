@@ -0,0 +1,22 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the event driven modbus tcp server
+ */
+#ifndef SERVER_DOT_H
+#define SERVER_DOT_H
+
+#include <modbus/modbus.h>
+#include "typedefs.h"
+
+#define SERVER_MAX_CONNECTIONS_DEFAULT   512
+#define SERVER_LISTEN_BACKLOG            128
+#define SERVER_WORKERS_MAX               64
+#define SERVER_DEFERRED_MAX              65536               // replies held back per worker, more go out at once
+#define SERVER_DATAGRAM_BATCH            64                  // datagrams per recvmmsg
+
+int  server_init(int port, int workers, const int* cpus, int cpu_count, int max_connections, bool udp);
+int  server_run(void);
+void server_stop(void);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Virtual simulation clock. The battery model and heartbeat run on virtual
+ * time, which either follows the monotonic clock scaled by a speed up factor
+ * or, in stepped mode, only advances when simclock_step is called. Stepped
+ * mode is fully deterministic: a step returns once the simulation thread has
+ * processed every tick up to the new time.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "simclock.h"
+#include "typedefs.h"
+
+// Private data
+static double speed = SIMCLOCK_SPEED_DEFAULT;
+static bool stepped = false;
+static bool stopped = false;
+static uint64_t origin;                              // monotonic time at start, ns
+static uint64_t virtual_now;                         // stepped mode time, ns
+static uint64_t waiting_for;                         // deadline the simulation is blocked on
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t advanced = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t caught_up = PTHREAD_COND_INITIALIZER;
+
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * SIMCLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+int simclock_init(double factor, bool step)
+{
+    if ( factor <= 0.0 )
+    {
+        return -1;
+    }
+    speed = factor;
+    stepped = step;
+    origin = monotonic_ns();
+    virtual_now = 0;
+    return 0;
+}
+
+bool simclock_stepped(void)
+{
+    return stepped;
+}
+
+double simclock_speed(void)
+{
+    return speed;
+}
+
+//
+// Virtual time in ns since start
+//
+uint64_t simclock_now(void)
+{
+    if ( stepped )
+    {
+        return __atomic_load_n(&virtual_now, __ATOMIC_ACQUIRE);
+    }
+    return (uint64_t)((monotonic_ns() - origin) * speed);
+}
+
+//
+// Block until virtual time reaches deadline. Returns -1 once the clock is stopped.
+//
+int simclock_wait(uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t wall;
+    int retval = 0;
+
+    if ( !stepped )
+    {
+        wall = origin + (uint64_t)(deadline / speed);
+        ts.tv_sec = wall / SIMCLOCK_NS_PER_SEC;
+        ts.tv_nsec = wall % SIMCLOCK_NS_PER_SEC;
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+        {
+        }
+        return __atomic_load_n(&stopped, __ATOMIC_ACQUIRE) ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    waiting_for = deadline;
+    pthread_cond_broadcast(&caught_up);
+    while ( virtual_now < deadline && !stopped )
+    {
+        pthread_cond_wait(&advanced, &lock);
+    }
+    if ( stopped )
+    {
+        retval = -1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return retval;
+}
+
+//
+// Stepped mode only: advance virtual time and wait for the simulation to catch up
+//
+int simclock_step(uint64_t ns)
+{
+    if ( !stepped )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&virtual_now, virtual_now + ns, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&advanced);
+    while ( waiting_for <= virtual_now && !stopped )
+    {
+        pthread_cond_wait(&caught_up, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+//
+// Stepped mode only: advance virtual time without waiting, simclock_caught_up
+// tells when the simulation is done
+//
+int simclock_advance(uint64_t ns)
+{
+    if ( !stepped )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&virtual_now, virtual_now + ns, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&advanced);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+//
+// Stepped mode only: true once the simulation has processed every tick up to
+// the virtual time, or has stopped
+//
+bool simclock_caught_up(void)
+{
+    bool retval;
+
+    pthread_mutex_lock(&lock);
+    retval = ( waiting_for > virtual_now || stopped );
+    pthread_mutex_unlock(&lock);
+
+    return retval;
+}
+
+void simclock_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&stopped, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&advanced);
+    pthread_cond_broadcast(&caught_up);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Header file for the virtual simulation clock
+ */
+#ifndef SIMCLOCK_DOT_H
+#define SIMCLOCK_DOT_H
+
+#include <stdint.h>
+#include "typedefs.h"
+
+#define SIMCLOCK_NS_PER_SEC        1000000000ULL
+#define SIMCLOCK_SPEED_DEFAULT     1.0
+#define SIMCLOCK_STEPS_MAX         3600            // largest single step request, one simulated hour
+
+int      simclock_init(double speed, bool stepped);
+bool     simclock_stepped(void);
+double   simclock_speed(void);
+uint64_t simclock_now(void);
+int      simclock_wait(uint64_t deadline);
+int      simclock_step(uint64_t ns);
+int      simclock_advance(uint64_t ns);
+bool     simclock_caught_up(void);
+void     simclock_stop(void);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Performance counters, see stats.h. Blocks are registered once per thread
+ * and never freed, a reader sums whatever blocks exist when it asks. The
+ * metrics endpoint is a minimal HTTP server on the loopback interface
+ * answering every request with the counters in the Prometheus text format,
+ * on a thread of its own so scraping never touches a worker.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <modbus/modbus.h>
+#include "stats.h"
+#include "log.h"
+
+#define STATS_RESPONSE_SIZE      16384
+#define STATS_REQUEST_SIZE       1024
+#define STATS_CLIENT_TIMEOUT     1                   // seconds a scraper gets to send its request
+
+// Private data
+static stats_t spare;                                // threads that never attached
+static stats_t* blocks[STATS_THREADS_MAX] = { &spare };
+static int block_count = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int listen_socket = -1;
+static pthread_t thread;
+
+__thread stats_t* stats = &spare;
+
+
+//
+// Give the calling thread a block of its own. Threads that cannot get one
+// keep counting into the spare block.
+//
+int stats_attach(void)
+{
+    stats_t* block;
+
+    if ( posix_memalign((void**)&block, 64, sizeof (stats_t)) != 0 )
+    {
+        return -1;
+    }
+    memset(block, 0, sizeof (stats_t));
+
+    pthread_mutex_lock(&lock);
+    if ( block_count == STATS_THREADS_MAX )
+    {
+        pthread_mutex_unlock(&lock);
+        free(block);
+        return -1;
+    }
+    blocks[block_count] = block;
+    __atomic_store_n(&block_count, block_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    stats = block;
+    return 0;
+}
+
+//
+// Time a batch of frames spent in the server, from the read that brought
+// them in to their replies going out
+//
+void stats_latency(uint64_t ns, uint64_t frames)
+{
+    int bucket = 0;
+
+    if ( frames == 0 )
+    {
+        return;
+    }
+    if ( ns > STATS_LATENCY_FIRST_NS )
+    {
+        bucket = 64 - __builtin_clzll((ns - 1) / STATS_LATENCY_FIRST_NS);
+        if ( bucket >= STATS_LATENCY_BUCKETS )
+        {
+            bucket = STATS_LATENCY_BUCKETS - 1;
+        }
+    }
+    stats_add(&stats->latency[bucket], frames);
+    stats_add(&stats->latency_count, frames);
+    stats_add(&stats->latency_sum, ns * frames);
+}
+
+//
+// Sum of every block, each counter as it was when read
+//
+void stats_collect(stats_t* total)
+{
+    const uint64_t* counter;
+    uint64_t* sum = (uint64_t*)total;
+    int count, i, j;
+
+    memset(total, 0, sizeof (stats_t));
+    count = __atomic_load_n(&block_count, __ATOMIC_ACQUIRE);
+    for ( i = 0; i < count; i++ )
+    {
+        counter = (const uint64_t*)blocks[i];
+        for ( j = 0; j < (int)(sizeof (stats_t) / sizeof (uint64_t)); j++ )
+        {
+            sum[j] += __atomic_load_n(&counter[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static uint64_t stats_requests_other(const stats_t* total)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for ( i = 0; i < STATS_FUNCTION_CODES; i++ )
+    {
+        if ( i != MODBUS_FC_READ_HOLDING_REGISTERS && i != MODBUS_FC_WRITE_SINGLE_REGISTER &&
+             i != MODBUS_FC_WRITE_MULTIPLE_REGISTERS && i != MODBUS_FC_WRITE_AND_READ_REGISTERS )
+        {
+            sum += total->requests[i];
+        }
+    }
+    return sum;
+}
+
+//
+// Fill count registers of the perfCounters block from register index on
+//
+void stats_registers(uint16_t* registers, uint16_t index, uint16_t count)
+{
+    uint64_t value[STATS_REG_COUNTERS];
+    uint64_t exceptions = 0;
+    stats_t total;
+    int i;
+
+    stats_collect(&total);
+    for ( i = 0; i < STATS_EXCEPTION_CODES; i++ )
+    {
+        exceptions += total.exceptions[i];
+    }
+
+    value[STATS_REG_FRAMES] = total.frames;
+    value[STATS_REG_EXCEPTIONS] = exceptions;
+    value[STATS_REG_CONNECTIONS] = total.connections;
+    value[STATS_REG_ACCEPTED] = total.accepted;
+    value[STATS_REG_HANDOVERS] = total.handovers;
+    value[STATS_REG_EXPIRIES] = total.expiries;
+    value[STATS_REG_OVERRUNS] = total.overruns;
+    value[STATS_REG_FC3] = total.requests[MODBUS_FC_READ_HOLDING_REGISTERS];
+    value[STATS_REG_FC6] = total.requests[MODBUS_FC_WRITE_SINGLE_REGISTER];
+    value[STATS_REG_FC16] = total.requests[MODBUS_FC_WRITE_MULTIPLE_REGISTERS];
+    value[STATS_REG_FC23] = total.requests[MODBUS_FC_WRITE_AND_READ_REGISTERS];
+    value[STATS_REG_FC_OTHER] = stats_requests_other(&total);
+    value[STATS_REG_ILLEGAL_FUNCTION] = total.exceptions[MODBUS_EXCEPTION_ILLEGAL_FUNCTION];
+    value[STATS_REG_ILLEGAL_ADDRESS] = total.exceptions[MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS];
+    value[STATS_REG_ILLEGAL_VALUE] = total.exceptions[MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE];
+    value[STATS_REG_BUSY] = total.exceptions[MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY];
+    value[STATS_REG_GATEWAY_TARGET] = total.exceptions[MODBUS_EXCEPTION_GATEWAY_TARGET];
+    value[STATS_REG_LATENCY_COUNT] = total.latency_count;
+    value[STATS_REG_LATENCY_SUM_NS] = total.latency_sum;
+    for ( i = 0; i < STATS_LATENCY_BUCKETS; i++ )
+    {
+        value[STATS_REG_LATENCY_BUCKET + i] = total.latency[i];
+    }
+
+    for ( i = index; i < index + count && i < STATS_REGISTERS; i++ )
+    {
+        registers[i - index] = value[i / 4] >> (48 - (i % 4) * 16);
+    }
+}
+
+//
+// The counters in the Prometheus text exposition format
+//
+static int stats_format(char* p, int size)
+{
+    stats_t total;
+    uint64_t cumulative = 0;
+    int i, length = 0;
+
+    stats_collect(&total);
+
+#define EMIT(...) \
+    do { if ( length < size ) length += snprintf(p + length, size - length, __VA_ARGS__); } while (0)
+
+    EMIT("# HELP tesla_frames_total Modbus requests answered.\n# TYPE tesla_frames_total counter\n");
+    EMIT("tesla_frames_total %llu\n", (unsigned long long)total.frames);
+    EMIT("# HELP tesla_requests_total Modbus requests by function code.\n# TYPE tesla_requests_total counter\n");
+    for ( i = 0; i < STATS_FUNCTION_CODES; i++ )
+    {
+        if ( total.requests[i] )
+        {
+            EMIT("tesla_requests_total{fc=\"%d\"} %llu\n", i, (unsigned long long)total.requests[i]);
+        }
+    }
+    EMIT("# HELP tesla_exceptions_total Exception replies by exception code.\n# TYPE tesla_exceptions_total counter\n");
+    for ( i = 0; i < STATS_EXCEPTION_CODES; i++ )
+    {
+        if ( total.exceptions[i] )
+        {
+            EMIT("tesla_exceptions_total{code=\"%d\"} %llu\n", i, (unsigned long long)total.exceptions[i]);
+        }
+    }
+    EMIT("# HELP tesla_connections Client connections open.\n# TYPE tesla_connections gauge\n");
+    EMIT("tesla_connections %lld\n", (long long)total.connections);
+    EMIT("# HELP tesla_connections_accepted_total Client connections accepted.\n# TYPE tesla_connections_accepted_total counter\n");
+    EMIT("tesla_connections_accepted_total %llu\n", (unsigned long long)total.accepted);
+    EMIT("# HELP tesla_handovers_total Connections passed to the worker owning their unit.\n# TYPE tesla_handovers_total counter\n");
+    EMIT("tesla_handovers_total %llu\n", (unsigned long long)total.handovers);
+    EMIT("# HELP tesla_heartbeat_expiries_total Heartbeat timeouts of any unit.\n# TYPE tesla_heartbeat_expiries_total counter\n");
+    EMIT("tesla_heartbeat_expiries_total %llu\n", (unsigned long long)total.expiries);
+    EMIT("# HELP tesla_tick_overruns_total Simulation ticks missed.\n# TYPE tesla_tick_overruns_total counter\n");
+    EMIT("tesla_tick_overruns_total %llu\n", (unsigned long long)total.overruns);
+    EMIT("# HELP tesla_reply_cache_hits_total Reads answered with a cached reply.\n# TYPE tesla_reply_cache_hits_total counter\n");
+    EMIT("tesla_reply_cache_hits_total %llu\n", (unsigned long long)total.reply_hits);
+    EMIT("# HELP tesla_request_latency_seconds Time requests spent in the server.\n# TYPE tesla_request_latency_seconds histogram\n");
+    for ( i = 0; i < STATS_LATENCY_BUCKETS - 1; i++ )
+    {
+        cumulative += total.latency[i];
+        EMIT("tesla_request_latency_seconds_bucket{le=\"%g\"} %llu\n",
+             (double)((uint64_t)STATS_LATENCY_FIRST_NS << i) / 1e9, (unsigned long long)cumulative);
+    }
+    EMIT("tesla_request_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)total.latency_count);
+    EMIT("tesla_request_latency_seconds_sum %.9f\n", total.latency_sum / 1e9);
+    EMIT("tesla_request_latency_seconds_count %llu\n", (unsigned long long)total.latency_count);
+
+#undef EMIT
+
+    return length < size ? length : size - 1;
+}
+
+static void stats_reply(int fd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    char request[STATS_REQUEST_SIZE];
+    char* response;
+    int length, sent;
+    ssize_t rc;
+
+    if ( recv(fd, request, sizeof (request), 0) <= 0 )             // the request itself does not matter
+    {
+        return;
+    }
+    response = malloc(STATS_RESPONSE_SIZE);
+    if ( response == NULL )
+    {
+        return;
+    }
+    memcpy(response, header, sizeof (header) - 1);
+    length = sizeof (header) - 1;
+    length += stats_format(response + length, STATS_RESPONSE_SIZE - length);
+
+    for ( sent = 0; sent < length; sent += rc )
+    {
+        rc = send(fd, response + sent, length - sent, MSG_NOSIGNAL);
+        if ( rc <= 0 )
+        {
+            break;
+        }
+    }
+    free(response);
+}
+
+static void* stats_thread(void* ptr)
+{
+    struct timeval timeout = { STATS_CLIENT_TIMEOUT, 0 };
+    int fd;
+
+    for (;;)
+    {
+        fd = accept(listen_socket, NULL, NULL);
+        if ( fd == -1 )
+        {
+            if ( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+            break;                                                   // stats_stop shut the socket down
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+        stats_reply(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+//
+// Serve the metrics on 127.0.0.1:port
+//
+int stats_serve(int port)
+{
+    struct sockaddr_in addr;
+    sigset_t all, previous;
+    int enable = 1, retval;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( listen_socket == -1 )
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ( setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable)) == -1 ||
+         bind(listen_socket, (struct sockaddr*)&addr, sizeof (addr)) == -1 ||
+         listen(listen_socket, 8) == -1 )
+    {
+        log_error("%s - cannot listen on 127.0.0.1:%d: %s\n", __PRETTY_FUNCTION__, port, strerror(errno));
+        close(listen_socket);
+        listen_socket = -1;
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    retval = pthread_create(&thread, NULL, stats_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if ( retval != 0 )
+    {
+        close(listen_socket);
+        listen_socket = -1;
+        return -1;
+    }
+
+    log_info("%s - metrics on http://127.0.0.1:%d/metrics\n", __PRETTY_FUNCTION__, port);
+    return 0;
+}
+
+void stats_stop(void)
+{
+    if ( listen_socket != -1 )
+    {
+        shutdown(listen_socket, SHUT_RDWR);                          // wakes up accept
+        pthread_join(thread, NULL);
+        close(listen_socket);
+        listen_socket = -1;
+    }
+}
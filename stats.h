@@ -0,0 +1,82 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Runtime performance counters. Every thread counts into a block of its own,
+ * a cache line aligned stats_t only that thread writes, so counting costs a
+ * plain add and never bounces a cache line between cores. The blocks are
+ * summed on demand, for the perfCounters register block and for the metrics
+ * endpoint.
+ */
+#ifndef STATS_DOT_H
+#define STATS_DOT_H
+
+#include <stdint.h>
+
+#define STATS_FUNCTION_CODES     128                 // function codes counted one by one
+#define STATS_EXCEPTION_CODES    16
+#define STATS_LATENCY_BUCKETS    16                  // 256ns doubling up to 4.2ms, then the rest
+#define STATS_LATENCY_FIRST_NS   256
+#define STATS_THREADS_MAX        80                  // workers, simulation and spare
+
+//
+// perfCounters register block: 64 bit counters, four registers each, most
+// significant word first
+//
+#define STATS_REG_FRAMES             0
+#define STATS_REG_EXCEPTIONS         1
+#define STATS_REG_CONNECTIONS        2               // open now
+#define STATS_REG_ACCEPTED           3
+#define STATS_REG_HANDOVERS          4
+#define STATS_REG_EXPIRIES           5               // heartbeat timeouts
+#define STATS_REG_OVERRUNS           6               // simulation ticks
+#define STATS_REG_FC3                7
+#define STATS_REG_FC6                8
+#define STATS_REG_FC16               9
+#define STATS_REG_FC23               10
+#define STATS_REG_FC_OTHER           11
+#define STATS_REG_ILLEGAL_FUNCTION   12
+#define STATS_REG_ILLEGAL_ADDRESS    13
+#define STATS_REG_ILLEGAL_VALUE      14
+#define STATS_REG_BUSY               15
+#define STATS_REG_GATEWAY_TARGET     16
+#define STATS_REG_LATENCY_COUNT      17
+#define STATS_REG_LATENCY_SUM_NS     18
+#define STATS_REG_LATENCY_BUCKET     19              // STATS_LATENCY_BUCKETS counts, not cumulative
+#define STATS_REG_COUNTERS           (STATS_REG_LATENCY_BUCKET + STATS_LATENCY_BUCKETS)
+#define STATS_REGISTERS              (STATS_REG_COUNTERS * 4)
+
+typedef struct stats_struct
+{
+    uint64_t frames;                                 // requests answered
+    uint64_t requests[STATS_FUNCTION_CODES];         // by function code
+    uint64_t exceptions[STATS_EXCEPTION_CODES];      // by exception code
+    uint64_t connections;                            // opened less closed here, wraps on the closing side
+    uint64_t accepted;
+    uint64_t handovers;                              // connections passed to another worker
+    uint64_t expiries;
+    uint64_t overruns;
+    uint64_t reply_hits;                             // reads answered from the reply cache
+    uint64_t latency_count;                          // frames timed
+    uint64_t latency_sum;                            // ns
+    uint64_t latency[STATS_LATENCY_BUCKETS];
+}__attribute__((aligned(64))) stats_t;
+
+extern __thread stats_t* stats;                      // block of the calling thread
+
+//
+// Counters are only written by the thread owning them, readers may load them
+// at any time
+//
+static inline void stats_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+int  stats_attach(void);
+void stats_latency(uint64_t ns, uint64_t frames);
+void stats_collect(stats_t* total);
+void stats_registers(uint16_t* registers, uint16_t index, uint16_t count);
+int  stats_serve(int port);
+void stats_stop(void);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Publishes live battery state into the status shared memory segment, see
+ * status.h for the layout. Replaces rewriting soc.json on every tick.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "status.h"
+#include "seqlock.h"
+#include "tesla.h"
+#include "typedefs.h"
+#include "log.h"
+
+// Private data
+static status_header_t* header = NULL;
+static status_record_t* records = NULL;
+static uint64_t tick_sim_time;
+static uint64_t tick_wall_time;
+
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Create (or resize) and map the segment. Failure is not fatal, the
+// simulator then runs without publishing status.
+//
+int status_init(int port, int unit_count)
+{
+    char name[32];
+    size_t size = sizeof (status_header_t) + unit_count * sizeof (status_record_t);
+    void* segment;
+    int fd, i;
+
+    snprintf(name, sizeof (name), STATUS_NAME_FORMAT, port);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if ( fd == -1 )
+    {
+        log_warn("%s - shm_open %s failed: %s\n", __PRETTY_FUNCTION__, name, strerror(errno));
+        return -1;
+    }
+    if ( ftruncate(fd, size) == -1 )
+    {
+        log_warn("%s - ftruncate %s failed: %s\n", __PRETTY_FUNCTION__, name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( segment == MAP_FAILED )
+    {
+        log_warn("%s - mmap %s failed: %s\n", __PRETTY_FUNCTION__, name, strerror(errno));
+        return -1;
+    }
+
+    header = segment;
+    records = (status_record_t*)(header + 1);
+
+    __atomic_store_n(&header->magic, 0, __ATOMIC_RELEASE);
+    memset(records, 0, unit_count * sizeof (status_record_t));
+    for ( i = 0; i < unit_count; i++ )
+    {
+        records[i].unit_id = i + 1;
+    }
+    header->version = STATUS_VERSION;
+    header->header_size = sizeof (status_header_t);
+    header->record_size = sizeof (status_record_t);
+    header->unit_count = unit_count;
+    header->pid = getpid();
+    header->started = realtime_ns();
+    header->ticks = 0;
+    header->tick_us = 0;
+    header->late_avg_us = 0;
+    header->late_max_us = 0;
+    header->overruns = 0;
+    __atomic_store_n(&header->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+
+    log_info("%s - live status in shared memory %s\n", __PRETTY_FUNCTION__, name);
+    return 0;
+}
+
+//
+// Start of a tick, every record published in it carries the same timestamps
+//
+void status_tick(uint64_t sim_time)
+{
+    if ( header == NULL )
+    {
+        return;
+    }
+    tick_sim_time = sim_time;
+    tick_wall_time = realtime_ns();
+    __atomic_store_n(&header->ticks, header->ticks + 1, __ATOMIC_RELEASE);
+}
+
+//
+// Tick timing, all in ns, lateness is wall clock time
+//
+void status_timing(uint64_t tick, uint64_t late_avg, uint64_t late_max, uint32_t overruns)
+{
+    if ( header == NULL )
+    {
+        return;
+    }
+    header->tick_us = tick / 1000;
+    header->late_avg_us = late_avg / 1000;
+    header->late_max_us = late_max / 1000;
+    header->overruns = overruns;
+}
+
+//
+// Simulation thread only, called once the unit has been stepped
+//
+void status_publish(const unit_t* unit)
+{
+    const battery_t* battery = &unit->battery;
+    status_record_t* record;
+
+    if ( records == NULL )
+    {
+        return;
+    }
+    record = &records[unit->unit_id - 1];
+
+    seqlock_write_begin(&record->sequence);
+    record->status = battery->battery_charging ? STATUS_CHARGING :
+                     battery->battery_discharging ? STATUS_DISCHARGING : STATUS_IDLE;
+    record->heartbeat_timeout = battery->heartbeatTimeout;
+    record->power = battery->power;
+    record->heartbeat_age = battery->heartbeat / 1000;
+    record->state_of_charge = battery->state_of_charge;
+    record->output = battery->output;
+    record->sim_time = tick_sim_time;
+    record->wall_time = tick_wall_time;
+    seqlock_write_end(&record->sequence);
+}
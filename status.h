@@ -0,0 +1,67 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Layout of the live status shared memory segment. The segment holds a header
+ * followed by one cache line per unit. Each record is guarded by its own
+ * seqlock: the simulation thread is the only writer, readers map the segment
+ * and copy records without any system call.
+ *
+ * The layout is fixed and versioned, readers must check magic and version and
+ * use header_size/record_size to locate records.
+ */
+#ifndef STATUS_DOT_H
+#define STATUS_DOT_H
+
+#include <stdint.h>
+
+#define STATUS_MAGIC             0x414C5354          // "TSLA"
+#define STATUS_VERSION           1
+#define STATUS_NAME_FORMAT       "/tesla.%d"         // shm_open name, by listen port
+
+#define STATUS_IDLE              0
+#define STATUS_CHARGING          1
+#define STATUS_DISCHARGING       2
+
+typedef struct status_header_struct
+{
+    uint32_t magic;                                  // written last, once the segment is valid
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t record_size;
+    uint16_t unit_count;
+    uint32_t pid;                                    // simulator process
+    uint64_t started;                                // CLOCK_REALTIME ns at start
+    uint64_t ticks;                                  // simulation ticks published
+    uint32_t tick_us;                                // simulated length of a tick
+    uint32_t late_avg_us;                            // wall clock lateness of ticks over the last second
+    uint32_t late_max_us;
+    uint32_t overruns;                               // ticks missed since start, folded into later ones
+    uint8_t  reserved[16];
+}status_header_t;
+
+typedef struct status_record_struct
+{
+    uint32_t sequence;                               // seqlock, odd while being updated
+    uint8_t  unit_id;
+    uint8_t  status;                                 // STATUS_IDLE, STATUS_CHARGING, STATUS_DISCHARGING
+    uint16_t heartbeat_timeout;                      // seconds
+    int32_t  power;                                  // active set point kW, negative charges
+    uint32_t heartbeat_age;                          // simulated seconds since last heartbeat
+    float    state_of_charge;                        // percent
+    float    output;                                 // kW delivered, negative charges
+    uint64_t sim_time;                               // simulated ns since start
+    uint64_t wall_time;                              // CLOCK_REALTIME ns of the update
+    uint8_t  reserved[24];
+}status_record_t;
+
+_Static_assert(sizeof (status_header_t) == 64, "status header layout changed");
+_Static_assert(sizeof (status_record_t) == 64, "status record layout changed");
+
+struct unit_struct;
+
+int  status_init(int port, int unit_count);
+void status_tick(uint64_t sim_time);
+void status_timing(uint64_t tick, uint64_t late_avg, uint64_t late_max, uint32_t overruns);
+void status_publish(const struct unit_struct* unit);
+
+#endif
@@ -3,198 +3,277 @@
 #include <byteswap.h>
 #include "tesla.h"
 #include "typedefs.h"
+#include "log.h"
+#include "simclock.h"
+#include "queue.h"
+#include "seqlock.h"
+#include "status.h"
+#include "checkpoint.h"
+#include "model.h"
+#include "stats.h"
+#include "fault.h"
+#include "image.h"
+#include "trace.h"
 #include <unistd.h>
 #include <modbus/modbus.h>
 #include <string.h>
 #include <time.h>
+#include <sys/prctl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
-#define BATTERY_POWER_RATING            230           // kW
-#define TIME_CHARGE_FROM_0_TO_100       3000          // seconds
-#define TIME_DISCHARGE_FROM_100_TO_0    2800          // seconds
 #define HEARTBEAT_TIMEOUT_DEFAULT       60
 #define STATE_OF_CHARGET_DEFAULT        50.0
 
 // Private data
 static modbus_t* ctx;
-static modbus_mapping_t *mb_mapping;
-static bool debug = false;
-
-static uint16_t heartbeatTimeout = HEARTBEAT_TIMEOUT_DEFAULT;
-static uint16_t heartbeat = 0;
+static unit_t* units;
+static int unit_count = 0;
+static fleet_t fleet;                              // model state of every unit, simulation thread only
+static dispatch_t dispatch_table[UT_REGISTERS_NB];
+static int shards = 1;
+static uint32_t ticks = 0;                         // simulation ticks completed, overruns included
+static uint32_t ticks_started = 0;                 // ticks whose commands have been applied
+
+__thread uint32_t query_tick = 0;
+__thread bool query_stepped = false;
+static __thread bool query_observed;               // query_tick taken from a unit snapshot
+static command_queue_t* commands;                  // one per shard, its worker -> simulation thread
+static uint64_t tick = SIMULATION_TICK_MS_DEFAULT * 1000000ULL;   // simulated ns per step
+static process_table_t telemetry_entry = {telemetryBlock, TELEMETRY_REGISTERS, process_telemetry, NULL};
 
 static int32_t StatusFullChargeEnergy = 100;
 static int32_t StatusNorminalEnergy   = 50;
 
-static float battery_discharge_decrement = 0.0;
-static float battery_charge_increment = 0.0;
-static bool battery_charging = false;
-static bool battery_discharging = false;
-
 static const uint16_t POWER_BLOCK_ALL = 2;
-static const uint32_t sign_bit_mask             = 0x80000000;
-
-static const float battery_charge_resolution    = 100.00 / (BATTERY_POWER_RATING * TIME_CHARGE_FROM_0_TO_100);     // % increase in charge per sec
-static const float battery_discharge_resolution = 100.00 / (BATTERY_POWER_RATING * TIME_DISCHARGE_FROM_100_TO_0);  // % decrease in charge per sec
-static const float battery_fully_charged        = 100.00;
-static const float battery_fully_discharged     = 0.0;
-static float state_of_charge = STATE_OF_CHARGET_DEFAULT;
 
 //
-// Lookup table for process functions
+// Lookup table for process functions. The read function refreshes the register
+// image before it is returned, the write function applies the side effect of a
+// register being written. Entries with a read function and no write function
+// are read only. Expanded into dispatch_table at start up.
 //
 const process_table_t process_table[] =
 {
-    {enableDebug,                       process_enableDebug},  // 16 bits
-    {dumpMemory,                         process_dumpMemory},  // 32 bits
-    {firmwareVersion,               process_firmwareVersion},  // 16 bits
-    {directRealTimeout,           process_directRealTimeout},  // 16 bits
-    {directRealHeartbeat,       process_directRealHeartbeat},  // 16 bits
-    {statusFullChargeEnergy, process_statusFullChargeEnergy},  // 32 bits
-    {statusNorminalEnergy,     process_statusNorminalEnergy},
-    {directPower,                       process_directPower},
-    {realMode,                             process_realMode},
-    {powerBlock,                         process_powerBlock},
-    { 0,                                               NULL}
+    {enableDebug,            1, NULL,                           process_enableDebug},          // 16 bits
+    {dumpMemory,             2, NULL,                           process_dumpMemory},           // 32 bits
+    {simulationStep,         1, NULL,                           process_simulationStep},       // 16 bits
+    {firmwareVersion,        3, process_firmwareVersion,        NULL},                         // 6 chars
+    {directRealTimeout,      1, NULL,                           process_directRealTimeout},    // 16 bits
+    {directRealHeartbeat,    1, NULL,                           process_directRealHeartbeat},  // 16 bits
+    {statusFullChargeEnergy, 2, process_statusFullChargeEnergy, NULL},                         // 32 bits
+    {statusNorminalEnergy,   2, process_statusNorminalEnergy,   NULL},                         // 32 bits
+    {directPower,            2, NULL,                           process_directPower},          // 32 bits
+    {realMode,               1, NULL,                           process_realMode},             // 16 bits
+    {powerBlock,             1, NULL,                           process_powerBlock},           // 16 bits
+    {perfCounters, STATS_REGISTERS, process_perfCounters,       NULL},                         // 64 bit counters
+    { 0,                     0, NULL,                           NULL}
 };
 
 
-int process_dumpMemory (uint16_t index, uint16_t value)
+int process_dumpMemory (unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    static uint32_t mem;
-    static uint32_t readings;
 
     //printf("%s - 0x%04X, index = %d \n", __PRETTY_FUNCTION__, value, index);
 
-    //if (debug) {
-    if ( index ) {
-        mem =  (mem << 16) + __bswap_16(value);
-        printf("%s - memory size %d \n", __PRETTY_FUNCTION__, mem);
-    }
+    unit->memory =  (unit->memory << 16) + __bswap_16(value);
+    log_debug("%s - unit %d memory size %d \n", __PRETTY_FUNCTION__, unit->unit_id, unit->memory);
 
     return retval;
 }
 
 //
-// Acks and dismisses alarms
+// Sets the log level: 0 info, 1 debug, 2 and above trace with libmodbus debug
 //
-int process_enableDebug (uint16_t index, uint16_t value)
+int process_enableDebug (unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    printf("%s - %s\n", __PRETTY_FUNCTION__, (value & 0x0001)?"TRUE":"FALSE");
-    debug = value?TRUE:FALSE;
-    modbus_set_debug(ctx, debug);
+    log_set_level(LOG_LEVEL_INFO + (value > 2 ? 2 : value));
+    log_info("%s - %s (log level %d)\n", __PRETTY_FUNCTION__, value?"TRUE":"FALSE", log_level);
+    modbus_set_debug(ctx, log_enabled(LOG_LEVEL_TRACE));
     return retval;
 }
 
+//
+// Hand a set point change to the simulation thread, applied at the next tick
+//
+static int tesla_command(unit_t* unit, command_type_t type, int32_t value)
+{
+    command_t command;
+
+    command.unit = unit;
+    command.type = type;
+    command.value = value;
+    if ( command_push(&commands[unit_shard(unit)], &command) == -1 )
+    {
+        log_warn("%s - command queue full, unit %d\n", __PRETTY_FUNCTION__, unit->unit_id);
+        return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+    }
+    return MODBUS_SUCCESS;
+}
+
+//
+// Advance a stepped simulation clock by value simulated seconds, at most
+// SIMCLOCK_STEPS_MAX a write. The step runs on the simulation thread, the
+// server holds the reply back until every unit has been stepped and does not
+// process the connection's next frames meanwhile.
+//
+int process_simulationStep (unit_t* unit, uint16_t index, uint16_t value)
+{
+    int retval = MODBUS_SUCCESS;
+
+    if ( !simclock_stepped() || value > SIMCLOCK_STEPS_MAX )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    log_debug("%s - %d seconds\n", __PRETTY_FUNCTION__, value);
+    query_tick = tesla_ticks();                  // replayed from the tick the step was written at
+    query_observed = true;
+    query_stepped = true;
+    simclock_advance(value * SIMCLOCK_NS_PER_SEC);
+    return retval;
+}
+
+//
+// Store a run of computed registers into the unit's image, a page shared
+// with the template is copied only if the run changes it
+//
+static int store_registers(unit_t* unit, uint16_t address, const uint16_t* registers, int count)
+{
+    int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( image_set(&unit->image, address + i, registers[i]) == -1 )
+        {
+            return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+        }
+    }
+    return MODBUS_SUCCESS;
+}
+
 //
 // report dummy version number
 //
-int process_firmwareVersion (uint16_t unused, uint16_t count )
+int process_firmwareVersion (unit_t* unit, uint16_t index, uint16_t count )
 {
-    uint16_t *address;
-    uint16_t address_offset;
     int i, retval = MODBUS_SUCCESS; // need to figure out what this constant is
     const char version[] = "V0.1.3";
-    const char *p = version;
+    const char *p = version + (index * 2);
+    uint16_t registers[3];
 
-    address_offset = mb_mapping->start_registers + firmwareVersion;
-    address = mb_mapping->tab_registers + address_offset;
     for ( i = 0; i < count; i++ )
     {
         uint16_t value  =  *p++;
-        address[i] = (value << 8) | *p++;
+        registers[i] = (value << 8) | *p++;
     }
+    retval = store_registers(unit, firmwareVersion + index, registers, count);
 
-    if (debug) {
-        printf("%s Version = %s \n", __PRETTY_FUNCTION__, version);
-    }
+    log_debug("%s Version = %s \n", __PRETTY_FUNCTION__, version);
     return retval;
 }
 
+//
+// Performance counters of the whole simulator, summed over every thread
+//
+int process_perfCounters (unit_t* unit, uint16_t index, uint16_t count)
+{
+    uint16_t registers[STATS_REGISTERS];
+
+    stats_registers(registers, index, count);
+    return store_registers(unit, perfCounters + index, registers, count);
+}
+
+static void put_long(uint16_t* registers, uint32_t value)
+{
+    registers[0] = value >> 16;
+    registers[1] = value & 0xFFFF;
+}
+
+//
+// Battery state of the last tick in one contiguous block. The snapshot is
+// taken under the unit seqlock, a read never mixes two ticks.
+//
+int process_telemetry (unit_t* unit, uint16_t index, uint16_t count)
+{
+    uint16_t block[TELEMETRY_REGISTERS];
+    battery_t battery;
+
+    query_tick = unit_snapshot(unit, &battery);
+    query_observed = true;
+    block[TELEMETRY_SOC] = (uint16_t)(battery.state_of_charge * 100.0 + 0.5);
+    block[TELEMETRY_STATUS] = battery.battery_charging ? TELEMETRY_CHARGING :
+                              battery.battery_discharging ? TELEMETRY_DISCHARGING : TELEMETRY_IDLE;
+    put_long(&block[TELEMETRY_SETPOINT], battery.power);
+    put_long(&block[TELEMETRY_OUTPUT], (int32_t)(battery.output * 1000.0f));
+    put_long(&block[TELEMETRY_HEARTBEAT_AGE], battery.heartbeat);
+    block[TELEMETRY_HEARTBEAT_TIMEOUT] = battery.heartbeatTimeout;
+    put_long(&block[TELEMETRY_FULL_CHARGE_ENERGY], StatusFullChargeEnergy);
+    put_long(&block[TELEMETRY_NOMINAL_ENERGY], StatusNorminalEnergy);
+
+    return store_registers(unit, telemetry_entry.address + index, &block[index], count);
+}
+
 //
 // Acks and dismisses alarms
 //
-int process_realMode (uint16_t index, uint16_t value)
+int process_realMode (unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    if (debug) {
-       printf("%s\n", __PRETTY_FUNCTION__);
-    }
+    log_debug("%s\n", __PRETTY_FUNCTION__);
     return retval;
 }
 //
 // Acks and dismisses alarms
 //process_directRealTimeout
-int process_directRealTimeout (uint16_t unused, uint16_t value)
+int process_directRealTimeout (unit_t* unit, uint16_t unused, uint16_t value)
 {
-    int retval = MODBUS_SUCCESS;
-    heartbeatTimeout = value;
-    if(debug) {
-        printf("%s heartbeatTimeout = %d\n", __PRETTY_FUNCTION__, heartbeatTimeout );
-    }
-    heartbeat = 0;
+    int retval;
+    log_debug("%s unit %d heartbeatTimeout = %d\n", __PRETTY_FUNCTION__, unit->unit_id, value );
+    retval = tesla_command(unit, COMMAND_TIMEOUT, value);
     return retval;
 }
 
 //
 // Heartbeat signal. Expected to toggle heartbeat bit very PGM HB Period
 //
-int process_directRealHeartbeat (uint16_t index, uint16_t value)
+int process_directRealHeartbeat (unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    static uint16_t previous_value = 0;
 
-    if (debug) {
-        printf("%s - value:%04x \n", __PRETTY_FUNCTION__, value);
-    }
+    log_debug("%s - unit %d value:%04x \n", __PRETTY_FUNCTION__, unit->unit_id, value);
 
-    if ( previous_value == value )
+    if ( unit->heartbeat_previous == value )
     {
-        heartbeat = 0;
+        retval = tesla_command(unit, COMMAND_HEARTBEAT, value);
     }
-    previous_value = ~value;
+    unit->heartbeat_previous = ~value;
     return retval;
 }
 
 
-int process_statusFullChargeEnergy(uint16_t index, uint16_t number_register)
+int process_statusFullChargeEnergy(unit_t* unit, uint16_t index, uint16_t number_register)
 {
-    uint16_t *address;
-    uint16_t address_offset;
-    int retval = MODBUS_SUCCESS; // need to figure out what this constant is
+    uint16_t registers[2];
+    int retval; // need to figure out what this constant is
 
-    address_offset = mb_mapping->start_registers + statusFullChargeEnergy;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address         = StatusFullChargeEnergy >> 16;
-        *(address+1)     = StatusFullChargeEnergy;
-    }
-    if (debug) {
-        printf("%s StatusFullChargeEnergy = %d\n", __PRETTY_FUNCTION__, StatusFullChargeEnergy );
-    }
+    put_long(registers, StatusFullChargeEnergy);
+    retval = store_registers(unit, statusFullChargeEnergy, registers, 2);
+    log_debug("%s StatusFullChargeEnergy = %d\n", __PRETTY_FUNCTION__, StatusFullChargeEnergy );
     return retval;
 }
 
-int process_statusNorminalEnergy(uint16_t index, uint16_t number_register)
+int process_statusNorminalEnergy(unit_t* unit, uint16_t index, uint16_t number_register)
 {
-    uint16_t *address;
-    uint16_t address_offset;
-    int retval = MODBUS_SUCCESS;
+    uint16_t registers[2];
+    int retval;
 
-    address_offset = mb_mapping->start_registers + statusNorminalEnergy;
-    address = mb_mapping->tab_registers + address_offset;
-    if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
-    {
-        *address         = StatusNorminalEnergy >> 16;
-        *(address+1)     = StatusNorminalEnergy;
-
-    }
-    if (debug) {
-        printf("%s StatusNorminalEnergy = %d\n", __PRETTY_FUNCTION__, StatusNorminalEnergy );
-    }
+    put_long(registers, StatusNorminalEnergy);
+    retval = store_registers(unit, statusNorminalEnergy, registers, 2);
+    log_debug("%s StatusNorminalEnergy = %d\n", __PRETTY_FUNCTION__, StatusNorminalEnergy );
 
     return retval;
 }
@@ -203,55 +282,28 @@ int process_statusNorminalEnergy(uint16_t index, uint16_t number_register)
 //
 // Total real power being delivered in kW: range(-32768  to 32767)
 //
-int process_directPower(uint16_t index, uint16_t value)
+int process_directPower(unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
-    static uint32_t val;
 
     if ( index == 0 )
     {
-        val = value << 16;
+        unit->direct_power = (uint32_t)value << 16;
     }
     else
     {
-        val  += value;                             // store set point value
-        if ( val & sign_bit_mask )
-        {
-            val = ((~val) + 1);                     // get 2nd complement value
-            if (debug) {
-                printf("%s - battery charging val(-%d)\n", __PRETTY_FUNCTION__, val);
-            }
-            battery_charging = true;
-            battery_discharging = false;
-            battery_charge_increment = ( val * battery_charge_resolution);  ;
-        }
-        else if (val > 0)
-        {
-            if (debug) {
-                printf("%s - battery discharging val(%d)\n", __PRETTY_FUNCTION__, val);
-            }
-            battery_discharging = true;
-            battery_charging = false;
-            battery_discharge_decrement = (val * battery_discharge_resolution);
-        }
-        else
-        {
-            if (debug) {
-                printf("%s - not charging val(%d)\n", __PRETTY_FUNCTION__, val);
-            }
-            battery_discharging = false;
-            battery_charging = false;
-        }
+        unit->direct_power += value;               // store set point value
+        retval = tesla_command(unit, COMMAND_POWER, (int32_t)unit->direct_power);
     }
 
     return retval;
 }
 
-int process_powerBlock(uint16_t index, uint16_t value)
+int process_powerBlock(unit_t* unit, uint16_t index, uint16_t value)
 {
     int retval = MODBUS_SUCCESS;
 
-    printf("%s - value(%d)\n", __PRETTY_FUNCTION__, value);
+    log_debug("%s - unit %d value(%d)\n", __PRETTY_FUNCTION__, unit->unit_id, value);
     //if ( value != POWER_BLOCK_ALL )
     //{
     //    retval = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
@@ -260,41 +312,205 @@ int process_powerBlock(uint16_t index, uint16_t value)
 }
 
 
-int process_handler(uint16_t address, uint16_t data)
+//
+// Write side effect of a single register, constant time lookup
+//
+int process_handler(unit_t* unit, uint16_t address, uint16_t data)
 {
-    int retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    const dispatch_t *d;
+    uint64_t start;
+    int retval;
+
+    if ( address >= UT_REGISTERS_NB )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    d = &dispatch_table[address];
+    if ( d->entry == NULL || d->entry->write == NULL )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    start = trace_begin();
+    retval = d->entry->write(unit, d->index, data);
+    trace_end(TRACE_HANDLER, start, unit->unit_id, address);
+    return retval;
+}
+
+//
+// Refresh the register image for a read. The start address has to be known,
+// each entry the range overlaps has its read function called once.
+//
+int process_read_registers(unit_t* unit, uint16_t start_address, uint16_t quantity)
+{
+    const dispatch_t *d;
+    int retval = MODBUS_SUCCESS;
+    uint16_t address, end, count;
+    uint64_t start;
 
-    for ( const process_table_t *p = process_table; p->handler != 0; p++ )
+    if ( start_address >= UT_REGISTERS_NB || dispatch_table[start_address].entry == NULL )
     {
-        if ( address == p->address )
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    start = trace_begin();
+    end = ( start_address + quantity < UT_REGISTERS_NB ) ? start_address + quantity : UT_REGISTERS_NB;
+    for ( address = start_address; address < end && retval == MODBUS_SUCCESS; address++ )
+    {
+        d = &dispatch_table[address];
+        if ( d->entry == NULL || d->entry->read == NULL )
         {
-            retval = p->handler(address, data);
-            break;
+            continue;
+        }
+        if ( address == start_address || d->index == 0 )
+        {
+            count = d->entry->size - d->index;
+            if ( count > end - address )
+            {
+                count = end - address;
+            }
+            retval = d->entry->read(unit, d->index, count);
         }
     }
+    trace_end(TRACE_HANDLER, start, unit->unit_id, start_address);
 
     return retval;
 }
 
+//
+// Copy a block of big endian registers off the wire into the register image,
+// eight registers a step with SSE2, four with a 64 bit word otherwise
+//
+static void registers_from_wire(uint16_t* dst, const uint8_t* src, int count)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(dst, src, count * 2);
+#else
+    uint64_t word;
+    int i = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 8 <= count; i += 8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    for ( ; i + 4 <= count; i += 4 )
+    {
+        memcpy(&word, src + i * 2, sizeof (word));
+        word = ((word & 0x00FF00FF00FF00FFULL) << 8) | ((word >> 8) & 0x00FF00FF00FF00FFULL);
+        memcpy(dst + i, &word, sizeof (word));
+    }
+    for ( ; i < count; i++ )
+    {
+        dst[i] = (src[i * 2] << 8) | src[i * 2 + 1];
+    }
+#endif
+}
 
-int process_write_multiple_addresses(uint16_t start_address, uint16_t quantity, uint8_t* pdata)
+//
+// Copy registers of the image onto the wire big endian, the reverse of
+// registers_from_wire
+//
+static void registers_to_wire(uint8_t* dst, const uint16_t* src, int count)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(dst, src, count * 2);
+#else
+    uint64_t word;
+    int i = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 8 <= count; i += 8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    for ( ; i + 4 <= count; i += 4 )
+    {
+        memcpy(&word, src + i, sizeof (word));
+        word = ((word & 0x00FF00FF00FF00FFULL) << 8) | ((word >> 8) & 0x00FF00FF00FF00FFULL);
+        memcpy(dst + i * 2, &word, sizeof (word));
+    }
+    for ( ; i < count; i++ )
+    {
+        dst[i * 2] = src[i] >> 8;
+        dst[i * 2 + 1] = src[i] & 0xFF;
+    }
+#endif
+}
+
+//
+// Run the write side effect of every register touched and store the block.
+// The whole block is checked first, nothing is stored if it runs past the
+// register image or covers a read only register. The handlers take their
+// values off the wire and the block is only stored once all of them have
+// succeeded, a handler failing, say on a full command queue, leaves the
+// image as it was. Handlers before the failing one keep their effect, as a
+// run of single register writes would.
+//
+int process_write_multiple_addresses(unit_t* unit, uint16_t start_address, uint16_t quantity, const uint8_t* pdata)
 {
+    const dispatch_t *d;
     int retval = MODBUS_SUCCESS;
+    bool handlers = false;
 
-    int i;
+    int i, n;
     uint16_t *address;
-    uint16_t address_offset;
+    uint64_t start;
+
+    if ( quantity < 1 || quantity > MODBUS_MAX_WRITE_REGISTERS || start_address + quantity > UT_REGISTERS_NB )
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
 
-    address_offset = mb_mapping->start_registers + start_address;
-    address = mb_mapping->tab_registers + address_offset;
+    d = &dispatch_table[start_address];
     for ( i = 0; i < quantity; i++ )
     {
-        if ( address < (mb_mapping->tab_registers + mb_mapping-> nb_registers) )
+        if ( d[i].entry != NULL )
+        {
+            if ( d[i].entry->write == NULL )
+            {
+                return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+            }
+            handlers = true;
+        }
+    }
+
+    // copy shared pages up front, storing the block can then no longer fail
+    for ( i = 0; i < quantity; i += n )
+    {
+        n = image_span(start_address + i, quantity - i);
+        if ( image_writable(&unit->image, start_address + i) == NULL )
+        {
+            return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+        }
+    }
+
+    start = handlers ? trace_begin() : 0;
+    for ( i = 0; handlers && i < quantity && retval == MODBUS_SUCCESS; i++ )
+    {
+        if ( d[i].entry != NULL )
         {
-            *address++  = (*pdata++ << 8) | *pdata++;
+            retval = d[i].entry->write(unit, d[i].index, (pdata[i * 2] << 8) | pdata[i * 2 + 1]);
         }
     }
+    trace_end(TRACE_HANDLER, start, unit->unit_id, start_address);
+    if ( retval != MODBUS_SUCCESS )
+    {
+        return retval;
+    }
 
+    unit->reply_epoch++;
+    for ( i = 0; i < quantity; i += n )
+    {
+        n = image_span(start_address + i, quantity - i);
+        address = image_writable(&unit->image, start_address + i);
+        registers_from_wire(address, pdata + i * 2, n);
+    }
 
     return retval;
 }
@@ -335,151 +551,688 @@ int process_write_multiple_addresses(uint16_t start_address, uint16_t quantity,
 **************************************************************************************************************
 */
 
-void process_query(modbus_pdu_t* mb)
+static inline uint16_t get_word(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_word(uint8_t* p, uint16_t value)
 {
-    const int convert_bytes2word_value = 256;
-    int i,j,retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+//
+// Reply builders, each fills in the MBAP header and returns the ADU length
+//
+static int reply_header(const modbus_pdu_t* mb, modbus_pdu_t* rsp, int pdu_length)
+{
+    rsp->mbap.transport_id = mb->mbap.transport_id;
+    rsp->mbap.protocol_id = 0;
+    rsp->mbap.length = __bswap_16(pdu_length + 1);                  // unit id + pdu
+    rsp->mbap.unit_id = mb->mbap.unit_id;
+    return sizeof (mbap_header_t) + pdu_length;
+}
+
+static int reply_exception(const modbus_pdu_t* mb, modbus_pdu_t* rsp, int code)
+{
+    stats_add(&stats->exceptions[code & (STATS_EXCEPTION_CODES - 1)], 1);
+    rsp->fcode = mb->fcode | 0x80;
+    rsp->data[0] = code;
+    return reply_header(mb, rsp, 2);
+}
+
+static int reply_echo(const modbus_pdu_t* mb, modbus_pdu_t* rsp)
+{
+    rsp->fcode = mb->fcode;
+    memcpy(rsp->data, mb->data, 4);                                  // address + value or quantity
+    return reply_header(mb, rsp, 5);
+}
+
+static int reply_registers(const modbus_pdu_t* mb, modbus_pdu_t* rsp, unit_t* unit, uint16_t address, uint16_t count)
+{
+    int i, n;
+
+    rsp->fcode = mb->fcode;
+    rsp->data[0] = count * 2;
+    for ( i = 0; i < count; i += n )
+    {
+        n = image_span(address + i, count - i);
+        registers_to_wire(&rsp->data[1 + i * 2], image_readable(&unit->image, address + i), n);
+    }
+    return reply_header(mb, rsp, 2 + count * 2);
+}
+
+//
+// Cached reply of a read, NULL unless the unit has been neither written nor
+// published by the simulation since it was built. A hit skips the read
+// functions and rebuilding the payload.
+//
+static const reply_cache_t* reply_cache_find(const unit_t* unit, uint16_t address, uint16_t count)
+{
+    const reply_cache_t* entry;
+    uint32_t now = __atomic_load_n(&unit->published_tick, __ATOMIC_ACQUIRE);
+    int i;
+
+    for ( i = 0; i < REPLY_CACHE_ENTRIES; i++ )
+    {
+        entry = &unit->reply[i];
+        if ( entry->address == address && entry->count == count &&
+             entry->epoch == unit->reply_epoch && entry->tick == now )
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+//
+// Keep the payload of a read reply just built, tick is the unit's published
+// tick read before the read functions ran. Short reads not covering perfCounters
+// only, those change on every request.
+//
+static void reply_cache_store(unit_t* unit, const modbus_pdu_t* rsp, uint16_t address, uint16_t count, uint32_t tick)
+{
+    reply_cache_t* entry;
+    int i;
+
+    if ( count > REPLY_CACHE_REGISTERS )
+    {
+        return;
+    }
+    for ( i = 0; i < count; i++ )
+    {
+        if ( dispatch_table[address + i].entry != NULL && dispatch_table[address + i].entry->read == process_perfCounters )
+        {
+            return;
+        }
+    }
+
+    for ( i = 0; i < REPLY_CACHE_ENTRIES; i++ )
+    {
+        if ( unit->reply[i].address == address && unit->reply[i].count == count )
+        {
+            break;
+        }
+    }
+    entry = ( i < REPLY_CACHE_ENTRIES ) ? &unit->reply[i] : &unit->reply[unit->reply_next++ & (REPLY_CACHE_ENTRIES - 1)];
+    entry->address = address;
+    entry->count = count;
+    entry->epoch = unit->reply_epoch;
+    entry->tick = tick;
+    memcpy(entry->data, rsp->data, 1 + count * 2);
+}
+
+static int reply_cached(const modbus_pdu_t* mb, modbus_pdu_t* rsp, const reply_cache_t* entry)
+{
+    stats_add(&stats->reply_hits, 1);
+    query_tick = entry->tick;                    // the state the reply was built from
+    query_observed = true;
+    rsp->fcode = mb->fcode;
+    memcpy(rsp->data, entry->data, 1 + entry->count * 2);
+    return reply_header(mb, rsp, 2 + entry->count * 2);
+}
+
+//
+// Process one complete MBAP frame and build its reply, see process_query
+//
+static int process_frame(modbus_pdu_t* mb, uint8_t* reply)
+{
+    modbus_pdu_t* rsp = (modbus_pdu_t*)reply;
+    int retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
     uint16_t address,value,count;
+    uint16_t read_address, read_count;
     int len = __bswap_16(mb->mbap.length) - 2; // len - fc - unit_id
+    const reply_cache_t* cached;
+    uint32_t tick_built;
+    int offset;
     uint8_t fc;
+    unit_t* unit;
 
-   // for ( i = 0; i < len; i++ ) {
-        fc = mb->fcode;
-        switch ( fc ){
-        case MODBUS_FC_READ_HOLDING_REGISTERS:
-            printf("%s MODBUS_FC_READ_HOLDING_REGISTERS\n", __PRETTY_FUNCTION__);
-            address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-            value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
-            retval  = process_handler(address, value);
-            break;
+    fc = mb->fcode;
+    stats_add(&stats->frames, 1);
+    stats_add(&stats->requests[fc < STATS_FUNCTION_CODES ? fc : 0], 1);
+
+    unit = unit_lookup(mb->mbap.unit_id);
+    if ( unit == NULL )
+    {
+        log_debug("%s - no battery at unit id %d\n", __PRETTY_FUNCTION__, mb->mbap.unit_id);
+        return reply_exception(mb, rsp, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    }
 
-        case MODBUS_FC_WRITE_SINGLE_REGISTER:
-            printf("%s MODBUS_FC_WRITE_SINGLE_REGISTER\n", __PRETTY_FUNCTION__);
-            address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-            value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
-            retval  = process_handler(address, value);
+    if ( fault_enabled )
+    {
+        // first written, else read, none when the frame is too short to carry it
+        offset  = ( fc == MODBUS_FC_WRITE_AND_READ_REGISTERS ) ? 4 : 0;
+        address = ( len >= offset + 2 ) ? get_word(&mb->data[offset]) : UT_REGISTERS_NB;
+        switch ( fault_check(unit, fc, address, &retval) )
+        {
+        case FAULT_DROP:
+            return 0;
+
+        case FAULT_EXCEPTION:
+            return reply_exception(mb, rsp, retval);
+        }
+    }
+
+    switch ( fc ){
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        log_trace("%s MODBUS_FC_READ_HOLDING_REGISTERS\n", __PRETTY_FUNCTION__);
+        address = get_word(&mb->data[0]);                // RS
+        count   = get_word(&mb->data[2]);                // RQ
+        if ( len < 4 || count < 1 || count > MODBUS_MAX_READ_REGISTERS )
+        {
+            retval = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        }
+        else if ( address + count > UT_REGISTERS_NB )
+        {
+            retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        }
+        else if ( (cached = reply_cache_find(unit, address, count)) != NULL )
+        {
+            return reply_cached(mb, rsp, cached);
+        }
+        else
+        {
+            tick_built = __atomic_load_n(&unit->published_tick, __ATOMIC_ACQUIRE);
+            retval = process_read_registers(unit, address, count);
+        }
+        if ( retval == MODBUS_SUCCESS )
+        {
+            len = reply_registers(mb, rsp, unit, address, count);
+            reply_cache_store(unit, rsp, address, count, tick_built);
+            return len;
+        }
+        break;
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        log_trace("%s MODBUS_FC_WRITE_SINGLE_REGISTER\n", __PRETTY_FUNCTION__);
+        address = get_word(&mb->data[0]);                // WS
+        value   = get_word(&mb->data[2]);                // data
+        retval  = ( len < 4 ) ? MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE : process_handler(unit, address, value);
+        unit->reply_epoch++;
+        if ( retval == MODBUS_SUCCESS && image_set(&unit->image, address, value) == -1 )
+        {
+            retval = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+        }
+        if ( retval == MODBUS_SUCCESS )
+        {
+            return reply_echo(mb, rsp);
+        }
+        break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        log_trace("%s MODBUS_FC_WRITE_MULTIPLE_REGISTERS\n", __PRETTY_FUNCTION__);
+        address = get_word(&mb->data[0]);                // WS
+        count   = get_word(&mb->data[2]);                // WQ
+        if ( len < 5 || count < 1 || count > MODBUS_MAX_WRITE_REGISTERS ||
+             mb->data[4] != count * 2 || len < 5 + count * 2 )
+        {
+            retval = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        }
+        else
+        {
+            retval = process_write_multiple_addresses(unit, address, count, &mb->data[5]);
+        }
+        if ( retval == MODBUS_SUCCESS )
+        {
+            return reply_echo(mb, rsp);
+        }
+        break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        log_trace("%s MODBUS_FC_WRITE_AND_READ_REGISTERS\n", __PRETTY_FUNCTION__);
+        read_address = get_word(&mb->data[0]);           // RS
+        read_count   = get_word(&mb->data[2]);           // RQ
+        address      = get_word(&mb->data[4]);           // WS
+        count        = get_word(&mb->data[6]);           // WQ
+        if ( len < 9 || read_count < 1 || read_count > MODBUS_MAX_WR_READ_REGISTERS ||
+             count < 1 || count > MODBUS_MAX_WR_WRITE_REGISTERS ||
+             mb->data[8] != count * 2 || len < 9 + count * 2 )
+        {
+            retval = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        }
+        else if ( read_address + read_count > UT_REGISTERS_NB )
+        {
+            retval = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        }
+        else
+        {
+            retval = process_write_multiple_addresses(unit, address, count, &mb->data[9]);
+            if ( retval == MODBUS_SUCCESS )
+            {
+                retval = process_read_registers(unit, read_address, read_count);
+            }
+        }
+        if ( retval == MODBUS_SUCCESS )
+        {
+            return reply_registers(mb, rsp, unit, read_address, read_count);
+        }
+        break;
+
+    default:
+        log_debug("%s - unsupported function code %d\n", __PRETTY_FUNCTION__, fc);
+        retval = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+        break;
+    }
+
+    return reply_exception(mb, rsp, retval);
+}
+
+//
+// Process one complete MBAP frame and build its reply, the reply buffer has to
+// hold MODBUS_TCP_MAX_ADU_LENGTH bytes. Returns the length of the reply, 0
+// when fault injection drops it. A reply to hold back leaves fault_delay set.
+//
+// The simulation tick the query saw is left in query_tick for the capture: the
+// tick of the battery state read, else the last tick whose commands were
+// applied once the query was done. A command the query queued is applied from
+// the tick after it.
+//
+int process_query(modbus_pdu_t* mb, uint8_t* reply)
+{
+    uint64_t start = trace_begin();
+    int length;
+
+    query_observed = false;
+    length = process_frame(mb, reply);
+    if ( !query_observed )
+    {
+        query_tick = __atomic_load_n(&ticks_started, __ATOMIC_SEQ_CST);
+    }
+    trace_end(TRACE_QUERY, start, mb->mbap.unit_id, mb->fcode);
+    return length;
+}
+
+//
+// Apply a new set point, simulation thread only. The model limits and ramps
+// the output towards it from the next step.
+//
+static void battery_set_power(unit_t* unit, int32_t power)
+{
+    log_debug("%s - unit %d set point %d kW\n", __PRETTY_FUNCTION__, unit->unit_id, power);
+    unit->battery.power = power;
+    fleet.power[unit - units] = power;
+}
+
+//
+// Apply the commands queued by one worker, called at a tick boundary
+//
+static void battery_apply_commands(command_queue_t* queue)
+{
+    command_t command;
+
+    while ( command_pop(queue, &command) == 0 )
+    {
+        battery_t* battery = &command.unit->battery;
+
+        switch ( command.type )
+        {
+        case COMMAND_POWER:
+            battery_set_power(command.unit, command.value);
             break;
 
-        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-            printf("%s MODBUS_FC_WRITE_MULTIPLE_REGISTERS\n", __PRETTY_FUNCTION__);
-            address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-            count = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++];   // register count
-            i++;                                             // skip over byte count
-            retval = process_write_multiple_addresses(address, count, &mb->data[i]);
-            i += (count*2);
+        case COMMAND_TIMEOUT:
+            battery->heartbeatTimeout = command.value;
+            battery->heartbeat = 0;
             break;
 
-        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
-            printf("%s MODBUS_FC_WRITE_AND_READ_REGISTERS\n", __PRETTY_FUNCTION__);
-            address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-            value   = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // data
-            retval  = process_handler(address, value);
-            address = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++]; // address
-            count = (mb->data[i++] * convert_bytes2word_value) + mb->data[i++];   // register count
-            i++;                                             // skip over byte count
-            retval = process_write_multiple_addresses(address, count, &mb->data[i]);
-            i += (count*2);
+        case COMMAND_HEARTBEAT:
+            battery->heartbeat = 0;
             break;
+        }
+    }
+}
+
+//
+// Advance one battery by the simulated ns elapsed since its last step, the
+// fleet has been stepped already
+//
+static void unit_step(unit_t* unit, uint64_t elapsed)
+{
+    battery_t* battery = &unit->battery;
+
+    if ( battery->heartbeat > battery->heartbeatTimeout * 1000U )
+    {
+        log_debug("%s: unit %d heartbeat expired, current timeout = %d\n", __PRETTY_FUNCTION__, unit->unit_id, battery->heartbeatTimeout );
+        battery->heartbeat = 0;
+        stats_add(&stats->expiries, 1);
+    }
+
+    model_fleet_store(&fleet, unit - units, battery);
+    battery->heartbeat += elapsed / 1000000;
+}
+
+//
+// Publish the battery state for readers on other threads
+//
+static void unit_publish(unit_t* unit)
+{
+    seqlock_write_begin(&unit->sequence);
+    unit->published = unit->battery;
+    __atomic_store_n(&unit->published_tick, ticks_started, __ATOMIC_RELEASE);
+    seqlock_write_end(&unit->sequence);
+}
+
+//
+// Consistent copy of the state published at the last tick, never blocks.
+// Returns the tick it was published at.
+//
+uint32_t unit_snapshot(const unit_t* unit, battery_t* battery)
+{
+    uint32_t sequence, published_tick;
+
+    do
+    {
+        sequence = seqlock_read_begin(&unit->sequence);
+        *battery = unit->published;
+        published_tick = __atomic_load_n(&unit->published_tick, __ATOMIC_RELAXED);
+    } while ( seqlock_read_retry(&unit->sequence, sequence) );
+    return published_tick;
+}
 
-        default:
-            if (debug)
+const char* battery_status(const battery_t* battery)
+{
+    if ( battery->battery_charging )
+    {
+        return "charging";
+    }
+    else if ( battery->battery_discharging )
+    {
+        return "discharging";
+    }
+    return "idle";
+}
+
+//
+// Move the telemetry block, 0 leaves it out. Called before tesla_init, the
+// block may not overlap another register of the map.
+//
+int tesla_telemetry(uint16_t address)
+{
+    const process_table_t *p;
+
+    if ( address != 0 && address + TELEMETRY_REGISTERS > UT_REGISTERS_NB )
+    {
+        return -1;
+    }
+    for ( p = process_table; address != 0 && p->size != 0; p++ )
+    {
+        if ( address < p->address + p->size && p->address < address + TELEMETRY_REGISTERS )
+        {
+            return -1;
+        }
+    }
+    telemetry_entry.address = address;
+    return 0;
+}
+
+//
+// Allocate the simulated batteries, one register image per unit id. The units
+// are dealt out round robin over shard_count shards, each shard is served by
+// one worker which alone touches the register images of its units.
+//
+int tesla_init(modbus_t* context, int count, int shard_count, uint64_t tick_ns)
+{
+    const process_table_t *p;
+    unit_t prototype;
+    int i, j;
+
+    for ( p = process_table; p->size != 0; p++ )
+    {
+        for ( j = 0; j < p->size && p->address + j < UT_REGISTERS_NB; j++ )
+        {
+            if ( dispatch_table[p->address + j].entry != NULL )
             {
-                printf ("default - %d\n", retval);
+                log_error("%s - register %d handled twice, entries at %d and %d overlap\n", __PRETTY_FUNCTION__,
+                          p->address + j, dispatch_table[p->address + j].entry->address, p->address);
+                return -1;
             }
-            retval = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+            dispatch_table[p->address + j].entry = p;
+            dispatch_table[p->address + j].index = j;
+        }
+    }
+    for ( j = 0; telemetry_entry.address != 0 && j < TELEMETRY_REGISTERS; j++ )
+    {
+        dispatch_table[telemetry_entry.address + j].entry = &telemetry_entry;
+        dispatch_table[telemetry_entry.address + j].index = j;
+    }
+
+    // constant registers go into the template every image starts out
+    // sharing, reading them later matches and copies nothing
+    memset(&prototype, 0, sizeof (prototype));
+    image_prototype(&prototype.image);
+    process_firmwareVersion(&prototype, 0, 3);
+    process_statusFullChargeEnergy(&prototype, 0, 2);
+    process_statusNorminalEnergy(&prototype, 0, 2);
+
+    ctx = context;
+    tick = tick_ns;
+    shards = shard_count;
+    if ( posix_memalign((void**)&commands, 64, shards * sizeof (command_queue_t)) != 0 )
+    {
+        commands = NULL;
+    }
+    units = calloc(count, sizeof (unit_t));
+    if ( units == NULL || commands == NULL || model_fleet_init(&fleet, count) == -1 )
+    {
+        free(units);
+        free(commands);
+        units = NULL;
+        commands = NULL;
+        return -1;
+    }
+    memset(commands, 0, shards * sizeof (command_queue_t));
+
+    for ( i = 0; i < count; i++ )
+    {
+        unit_t* unit = &units[i];
+
+        image_init(&unit->image);
+        unit->unit_id = i + 1;
+        unit->random = 2463534242u ^ unit->unit_id;
+        unit->battery.heartbeatTimeout = HEARTBEAT_TIMEOUT_DEFAULT;
+        unit->battery.state_of_charge = STATE_OF_CHARGET_DEFAULT;
+        model_fleet_load(&fleet, i, &unit->battery);
+        unit_publish(unit);
+    }
+    unit_count = count;
+
+    return 0;
+}
+
+//
+// Worker of the shard only, the register images are its own and the battery
+// state is taken from the last published tick. The checkpoint is committed
+// once every shard has written its units.
+//
+void tesla_checkpoint(int shard)
+{
+    checkpoint_unit_t* slot = checkpoint_begin(shard);
+    checkpoint_unit_t* record;
+    unit_t* unit;
+    uint64_t start = trace_begin();
+    int i, count = 0, pages = 0;
+
+    if ( slot == NULL )
+    {
+        return;
+    }
+    for ( i = shard; i < unit_count; i += shards, count++ )
+    {
+        unit = &units[i];
+        record = &slot[i];
+        record->unit_id = unit->unit_id;
+        record->heartbeat_previous = unit->heartbeat_previous;
+        record->direct_power = unit->direct_power;
+        record->memory = unit->memory;
+        unit_snapshot(unit, &record->battery);
+        image_save(&unit->image, record->registers, UT_REGISTERS_NB);
+        pages += image_private(&unit->image);
+    }
+    checkpoint_commit(shard);
+    trace_end(TRACE_CHECKPOINT, start, 0, count);
+    log_debug("%s - shard %d, %d units, %d private register pages\n", __PRETTY_FUNCTION__, shard, count, pages);
+}
+
+//
+// Warm start from the checkpoint found by checkpoint_init, before the
+// simulation thread is started. Returns the number of units restored.
+//
+int tesla_restore(void)
+{
+    const checkpoint_unit_t* record;
+    unit_t* unit;
+    int count, i, restored = 0;
+
+    record = checkpoint_restore(&count);
+    for ( i = 0; record != NULL && i < count; i++, record++ )
+    {
+        if ( record->unit_id == 0 || record->unit_id > unit_count )
+        {
+            continue;
+        }
+        unit = &units[record->unit_id - 1];
+        unit->heartbeat_previous = record->heartbeat_previous;
+        unit->direct_power = record->direct_power;
+        unit->memory = record->memory;
+        unit->battery = record->battery;
+        model_fleet_load(&fleet, record->unit_id - 1, &unit->battery);
+        if ( image_store(&unit->image, 0, record->registers, UT_REGISTERS_NB) == -1 )
+        {
             break;
         }
-   // }
-    if ( retval == MODBUS_SUCCESS)
-        modbus_reply(ctx, (uint8_t*)mb, sizeof(mbap_header_t) + sizeof(fc) + len, mb_mapping); // subtract function code
-    else
-       modbus_reply_exception(ctx, (uint8_t*)mb, retval);
+        unit_publish(unit);
+        restored++;
+    }
+    if ( restored )
+    {
+        log_info("%s - resumed %d units from checkpoint\n", __PRETTY_FUNCTION__, restored);
+    }
+
+    return restored;
+}
+
+//
+// Simulation ticks completed so far, the ticks of an overrun included
+//
+uint32_t tesla_ticks(void)
+{
+    return __atomic_load_n(&ticks, __ATOMIC_ACQUIRE);
 }
 
-void update_json_file(float soc, const char* status)
+//
+// Shard, and so worker, a unit belongs to
+//
+int unit_shard(const unit_t* unit)
 {
-    FILE *fp;
-    const char* filename = "soc.json";
+    return (unit->unit_id - 1) % shards;
+}
 
-    fp = fopen ( filename, "w");
-    if ( fp )
+//
+// Map the MBAP unit id onto a simulated battery. A single battery answers
+// to every unit id, as before multiplexing existed.
+//
+unit_t* unit_lookup(uint8_t unit_id)
+{
+    if ( unit_count == 1 )
     {
-        //rewind(fp);
-        fprintf(fp,
-                "{" \
-                    "\"stateOfCharge\": {"  \
-                        "\"charge\":\"%f\", " \
-                        "\"status\":\"%s\", " \
-                        "\"time\":\"%08ld\" " \
-                    "}" \
-                "}\n", soc, status, time(NULL));
-        //fputs(s, fp);
-        fclose(fp);
+        return &units[0];
     }
+    if ( unit_id == 0 || unit_id > unit_count )
+    {
+        return NULL;
+    }
+    return &units[unit_id - 1];
 }
 
 //
-// Thread handler
+// Thread handler. Ticks are absolute deadlines on the simulation clock and
+// every step integrates the simulated time since the previous one. In real
+// time a tick that wakes up after the next deadline has passed overran, the
+// missed ticks are folded into it rather than run back to back. Lateness and
+// overruns are published once per wall clock second.
 //
 void *handler( void *ptr )
 {
-    char *terminate;
-    char status[12] = "idle";
+    uint8_t *terminate;
     thread_param_t* param = (thread_param_t*) ptr;
-    ctx = param->ctx;
-    mb_mapping = param->mb_mapping;
+    bool stepped = simclock_stepped();
+    uint64_t window = (uint64_t)(SIMCLOCK_NS_PER_SEC * simclock_speed());    // one wall second
+    uint64_t next, last, step, report, now, late, missed, start;
+    uint64_t late_sum = 0, late_max = 0, samples = 0;
+    uint32_t overruns = 0, overruns_reported = 0;
+    int i;
+
     terminate = param->terminate;
     free(param);
 
+    prctl(PR_SET_TIMERSLACK, 1);                       // wake up on time for ms ticks
+    stats_attach();
+    trace_attach("simulation");
+    next = last = simclock_now();
+    report = next + window;
     while ( *terminate == false )
     {
-        sleep(1);
-        if ( heartbeat > heartbeatTimeout )
+        next += tick;
+        if ( simclock_wait(next) == -1 )
         {
-            if ( debug ) {
-                printf("%s: heartbeat expired, current timeout = %d\n", __PRETTY_FUNCTION__, heartbeatTimeout );
-            }
-            heartbeat = 0;
+            break;
         }
 
-        if (battery_charging)
+        if ( !stepped )
         {
-            if ( debug ) {
-                strcpy(status,"charging");
-            }
-            if ( (state_of_charge + battery_charge_increment) <= battery_fully_charged )
+            now = simclock_now();
+            late = ( now > next ) ? now - next : 0;
+            if ( late >= tick )
             {
-                state_of_charge += battery_charge_increment;
+                missed = late / tick;
+                next += missed * tick;
+                overruns += missed;
+                stats_add(&stats->overruns, missed);
             }
-            else
+            late_sum += late;
+            late_max = ( late > late_max ) ? late : late_max;
+            samples++;
+
+            if ( now >= report )
             {
-                state_of_charge = battery_fully_charged;
-                battery_charging = false;
+                status_timing(tick, late_sum / samples / simclock_speed(), late_max / simclock_speed(), overruns);
+                if ( overruns != overruns_reported )
+                {
+                    log_warn("%s - %u ticks overran, %llu us late at worst\n", __PRETTY_FUNCTION__,
+                             overruns - overruns_reported, (unsigned long long)(late_max / simclock_speed() / 1000));
+                    overruns_reported = overruns;
+                }
+                late_sum = late_max = samples = 0;
+                report = now + window;
             }
         }
-        else if (battery_discharging)
+
+        start = trace_begin();
+        __atomic_store_n(&ticks_started, ticks + (next - last) / tick, __ATOMIC_SEQ_CST);   // overrun ticks count too
+        for ( i = 0; i < shards; i++ )
         {
-            if ( debug ) {
-                strcpy(status,"discharging");
-            }
-            if ( (state_of_charge - battery_discharge_decrement) >= battery_fully_discharged )
-            {
-                state_of_charge -= battery_discharge_decrement;
-            }
-            else
+            battery_apply_commands(&commands[i]);
+        }
+        status_tick(next);
+        for ( step = last; step < next; step += tick )   // overrun ticks one at a time, as a replay steps them
+        {
+            model_fleet_step(&fleet, (float)tick / SIMCLOCK_NS_PER_SEC);
+            for ( i = 0; i < unit_count; i++ )
             {
-                state_of_charge = battery_fully_discharged;
-                battery_discharging = false;
+                unit_step(&units[i], tick);
             }
         }
-        else
+        for ( i = 0; i < unit_count; i++ )
         {
-            if ( debug ) {
-                strcpy(status,"idle");
-            }
+            unit_publish(&units[i]);
+            status_publish(&units[i]);
         }
-        //update_json_file(state_of_charge, (const char*)status);
-        heartbeat++;
+        __atomic_store_n(&ticks, ticks_started, __ATOMIC_RELEASE);
+        trace_end(TRACE_TICK, start, 0, unit_count);
+        last = next;
     }
-}
 
+    return NULL;
+}
@@ -9,9 +9,11 @@
 #include <stdint.h>
 #include <modbus/modbus.h>
 #include "typedefs.h"
+#include "simclock.h"
 
 #define enableDebug                   1
 #define dumpMemory                    2
+#define simulationStep                4
 #define firmwareVersion               101
 #define directRealTimeout             1023
 #define directRealHeartbeat           1022
@@ -20,22 +22,63 @@
 #define directPower                   1020
 #define realMode                      1000
 #define powerBlock                    1002
+#define perfCounters                  1800          // STATS_REGISTERS read only, see stats.h
+#define telemetryBlock                1200          // TELEMETRY_REGISTERS read only, default address
 
 
+#define UT_REGISTERS_NB               0x07FF        // holding registers per battery
+#define UNITS_MAX                     247           // highest modbus slave address
+#define SIMULATION_TICK_MS_DEFAULT    100           // simulation step, simulated ms
+#define SIMULATION_TICK_MS_MAX        1000
+
+//
+// Telemetry block, the battery state of the last tick in a single FC3 read.
+// 32 bit values take two registers, most significant word first.
+//
+#define TELEMETRY_SOC                 0             // state of charge, 0.01 %
+#define TELEMETRY_STATUS              1             // TELEMETRY_IDLE, _CHARGING or _DISCHARGING
+#define TELEMETRY_SETPOINT            2             // active set point, kW, signed
+#define TELEMETRY_OUTPUT              4             // power delivered, W, signed, negative charges
+#define TELEMETRY_HEARTBEAT_AGE       6             // simulated ms since the last heartbeat
+#define TELEMETRY_HEARTBEAT_TIMEOUT   8             // s
+#define TELEMETRY_FULL_CHARGE_ENERGY  9             // as statusFullChargeEnergy
+#define TELEMETRY_NOMINAL_ENERGY      11            // as statusNorminalEnergy
+#define TELEMETRY_REGISTERS           13
+
+#define TELEMETRY_IDLE                0
+#define TELEMETRY_CHARGING            1
+#define TELEMETRY_DISCHARGING         2
+
+extern __thread uint32_t query_tick;                // simulation tick the last query saw, see process_query
+extern __thread bool query_stepped;                 // the last query stepped the clock, reply once simclock_caught_up
+
 // proclet
-int process_enableDebug (uint16_t, uint16_t );
-int process_dumpMemory (uint16_t, uint16_t );
-int process_firmwareVersion (uint16_t, uint16_t );
-int process_directRealTimeout (uint16_t, uint16_t );
-int process_directRealHeartbeat( uint16_t, uint16_t );
-int process_statusFullChargeEnergy(uint16_t, uint16_t );
-int process_statusNorminalEnergy (uint16_t, uint16_t );
-int process_directPower( uint16_t, uint16_t  );
-int process_realMode( uint16_t, uint16_t  );
-int process_powerBlock( uint16_t, uint16_t  );
-
-int process_multiple_registers(uint16_t start_address, uint16_t quantity, uint8_t* pdata);
-int  process_handler(uint16_t, uint16_t);
-void process_query(modbus_pdu_t*);
+int process_enableDebug (unit_t*, uint16_t, uint16_t );
+int process_dumpMemory (unit_t*, uint16_t, uint16_t );
+int process_simulationStep (unit_t*, uint16_t, uint16_t );
+int process_firmwareVersion (unit_t*, uint16_t, uint16_t );
+int process_directRealTimeout (unit_t*, uint16_t, uint16_t );
+int process_directRealHeartbeat( unit_t*, uint16_t, uint16_t );
+int process_statusFullChargeEnergy(unit_t*, uint16_t, uint16_t );
+int process_statusNorminalEnergy (unit_t*, uint16_t, uint16_t );
+int process_directPower( unit_t*, uint16_t, uint16_t  );
+int process_realMode( unit_t*, uint16_t, uint16_t  );
+int process_powerBlock( unit_t*, uint16_t, uint16_t  );
+int process_perfCounters( unit_t*, uint16_t, uint16_t  );
+int process_telemetry( unit_t*, uint16_t, uint16_t  );
+
+int process_write_multiple_addresses(unit_t* unit, uint16_t start_address, uint16_t quantity, const uint8_t* pdata);
+int process_read_registers(unit_t* unit, uint16_t start_address, uint16_t quantity);
+int  process_handler(unit_t*, uint16_t, uint16_t);
+int  process_query(modbus_pdu_t* query, uint8_t* reply);
+uint32_t tesla_ticks(void);
+int  tesla_telemetry(uint16_t address);
+int  tesla_init(modbus_t* ctx, int count, int shards, uint64_t tick);
+unit_t* unit_lookup(uint8_t unit_id);
+int  unit_shard(const unit_t* unit);
+void tesla_checkpoint(int shard);
+int  tesla_restore(void);
+uint32_t unit_snapshot(const unit_t* unit, battery_t* battery);
+const char* battery_status(const battery_t* battery);
 void *handler( void *ptr );
 #endif
@@ -0,0 +1,13 @@
+# Battery profile for tesla -b, see model.c for the format.
+# A 230kW / 210kWh unit with taper near full and empty, power dependent
+# losses and a 50kW/s ramp.
+
+rating               = 230                      # kW
+capacity             = 210                      # kWh
+ramp                 = 50                       # kW per second
+
+charge_limit         = 0:230 85:230 95:80 100:10      # kW by SoC %
+discharge_limit      = 0:10 5:80 15:230               # kW by SoC %
+
+charge_efficiency    = 0:0.90 20:0.96 100:0.95        # by power, % of rating
+discharge_efficiency = 0:0.90 20:0.96 100:0.94
@@ -0,0 +1,256 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Request stage tracing, see trace.h. Rings are registered once per thread
+ * and never freed. A dump copies each ring while its thread carries on and
+ * keeps only the events that cannot have been overwritten during the copy,
+ * then writes them with the cycle counter turned into microseconds since
+ * tracing started. The file is written next to the target and renamed over
+ * it, a reader never sees half a dump.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "typedefs.h"
+#include "log.h"
+
+#define TRACE_PATH_LENGTH        256
+
+// Private data
+static const char* stage_names[TRACE_STAGES] =
+{
+    "receive", "process_query", "handler", "send", "adopt", "checkpoint", "tick"
+};
+static const char* arg_names[TRACE_STAGES] =
+{
+    "bytes", "fc", "address", "bytes", "connections", "units", "units"
+};
+static trace_ring_t* rings[TRACE_THREADS_MAX];
+static int ring_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static char path[TRACE_PATH_LENGTH];
+static bool enabled = false;
+static volatile sig_atomic_t stopping = 0;
+static pthread_t thread;
+static uint64_t start_cycles;                      // trace_clock at trace_init
+static uint64_t start_ns;                          // CLOCK_MONOTONIC at trace_init
+static trace_event_t* copy;                        // dump scratch, one ring
+
+__thread trace_ring_t* trace_ring = NULL;
+
+
+static uint64_t trace_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Copy the events of a ring, oldest first, and return their number. Those
+// from first on are known to be intact.
+//
+static int trace_copy(trace_ring_t* ring, uint64_t* first)
+{
+    uint64_t head, oldest, intact, i;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    oldest = ( head > TRACE_EVENTS ) ? head - TRACE_EVENTS : 0;
+    for ( i = oldest; i < head; i++ )
+    {
+        copy[i - oldest] = ring->event[i & (TRACE_EVENTS - 1)];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // events recorded meanwhile may have overwritten the oldest ones copied,
+    // so may the one being written as the copy ended
+    intact = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+    intact = ( intact > TRACE_EVENTS ) ? intact - TRACE_EVENTS : 0;
+    *first = ( intact > oldest ) ? intact - oldest : 0;
+    return head - oldest;
+}
+
+//
+// Write every ring as Chrome trace events, complete events with their stage
+// as name, one track per thread. Returns the number of events or -1.
+//
+int trace_dump(void)
+{
+    char temporary[TRACE_PATH_LENGTH + 8];
+    trace_event_t* e;
+    double us_per_cycle;
+    uint64_t cycles, first;
+    int count, i, j, n, total = 0, pid = getpid();
+    FILE* fp;
+
+    if ( !enabled )
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&dump_lock);
+    cycles = trace_clock() - start_cycles;
+    us_per_cycle = cycles ? (double)(trace_ns() - start_ns) / cycles / 1000.0 : 0.0;
+
+    snprintf(temporary, sizeof (temporary), "%s.tmp", path);
+    fp = fopen(temporary, "w");
+    if ( fp == NULL )
+    {
+        log_error("%s - cannot write %s: %s\n", __PRETTY_FUNCTION__, temporary, strerror(errno));
+        pthread_mutex_unlock(&dump_lock);
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tesla\"}}", pid);
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for ( i = 0; i < count; i++ )
+    {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                pid, rings[i]->tid, rings[i]->name);
+
+        n = trace_copy(rings[i], &first);
+        for ( j = (int)first; j < n; j++ )
+        {
+            e = &copy[j];
+            if ( e->stage >= TRACE_STAGES || e->start < start_cycles )
+            {
+                continue;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"modbus\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"unit\":%u,\"%s\":%u}}",
+                    stage_names[e->stage], pid, rings[i]->tid, (e->start - start_cycles) * us_per_cycle,
+                    e->duration * us_per_cycle, e->unit, arg_names[e->stage], e->arg);
+            total++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+
+    if ( fclose(fp) != 0 || rename(temporary, path) == -1 )
+    {
+        log_error("%s - cannot write %s: %s\n", __PRETTY_FUNCTION__, path, strerror(errno));
+        unlink(temporary);
+        total = -1;
+    }
+    pthread_mutex_unlock(&dump_lock);
+
+    if ( total != -1 )
+    {
+        log_info("%s - %d events of %d threads written to %s\n", __PRETTY_FUNCTION__, total, count, path);
+    }
+    return total;
+}
+
+//
+// Dumps on every SIGUSR1 until trace_stop
+//
+static void* trace_thread(void* unused)
+{
+    sigset_t wanted;
+    int signo;
+
+    sigemptyset(&wanted);
+    sigaddset(&wanted, SIGUSR1);
+    while ( sigwait(&wanted, &signo) == 0 && !stopping )
+    {
+        trace_dump();
+    }
+    return NULL;
+}
+
+//
+// Enable tracing into the file at path, before the traced threads start.
+// SIGUSR1 has to be blocked in every thread, the dump thread takes it.
+//
+int trace_init(const char* file)
+{
+    sigset_t all, previous;
+    int retval;
+
+    if ( strlen(file) >= sizeof (path) )
+    {
+        log_error("%s - trace file name too long\n", __PRETTY_FUNCTION__);
+        return -1;
+    }
+    copy = malloc(TRACE_EVENTS * sizeof (trace_event_t));
+    if ( copy == NULL )
+    {
+        return -1;
+    }
+    strcpy(path, file);
+    start_ns = trace_ns();
+    start_cycles = trace_clock();
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    retval = pthread_create(&thread, NULL, trace_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if ( retval != 0 )
+    {
+        free(copy);
+        copy = NULL;
+        return -1;
+    }
+
+    enabled = true;
+    log_info("%s - tracing to %s, kill -USR1 %d writes it\n", __PRETTY_FUNCTION__, path, (int)getpid());
+    return 0;
+}
+
+//
+// Give the calling thread a ring of its own if tracing is enabled. Threads
+// beyond TRACE_THREADS_MAX are not traced.
+//
+void trace_attach(const char* name)
+{
+    trace_ring_t* ring;
+
+    if ( !enabled )
+    {
+        return;
+    }
+    if ( posix_memalign((void**)&ring, 64, sizeof (trace_ring_t)) != 0 )
+    {
+        log_warn("%s - no trace ring for %s\n", __PRETTY_FUNCTION__, name);
+        return;
+    }
+    memset(ring, 0, sizeof (trace_ring_t));
+    ring->tid = syscall(SYS_gettid);
+    snprintf(ring->name, sizeof (ring->name), "%s", name);
+
+    pthread_mutex_lock(&lock);
+    if ( ring_count == TRACE_THREADS_MAX )
+    {
+        pthread_mutex_unlock(&lock);
+        free(ring);
+        return;
+    }
+    rings[ring_count] = ring;
+    __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    trace_ring = ring;
+}
+
+//
+// Stop the dump thread and write the rings a last time, once the traced
+// threads are done
+//
+void trace_stop(void)
+{
+    if ( !enabled )
+    {
+        return;
+    }
+    stopping = 1;
+    pthread_kill(thread, SIGUSR1);
+    pthread_join(thread, NULL);
+    trace_dump();
+}
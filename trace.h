@@ -0,0 +1,124 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Request stage tracing. Each traced thread records the stages it runs,
+ * socket reads, process_query, handler dispatch, socket writes, the
+ * simulation tick, into a ring of its own, time stamped with the cycle
+ * counter. Nothing is shared while recording, a ring keeps the last
+ * TRACE_EVENTS stages of its thread. The rings are written out as Chrome
+ * trace event JSON, loadable in chrome://tracing and Perfetto, on SIGUSR1
+ * and when the simulator stops.
+ *
+ * Threads only get a ring when tracing is enabled, otherwise a stage costs
+ * a thread local load and a branch. Building with -DNO_TRACE leaves the
+ * stages out altogether.
+ */
+#ifndef TRACE_DOT_H
+#define TRACE_DOT_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_EVENTS             65536               // per thread, power of 2, 16 bytes each
+#define TRACE_THREADS_MAX        80
+#define TRACE_NAME_LENGTH        16
+
+typedef enum
+{
+    TRACE_RECEIVE = 0,                               // read or recvmmsg, arg bytes or datagrams
+    TRACE_QUERY,                                     // process_query, decode to reply built, arg function code
+    TRACE_HANDLER,                                   // register handler dispatch, arg first register
+    TRACE_SEND,                                      // send or sendmmsg, arg bytes or datagrams
+    TRACE_ADOPT,                                     // connections taken over from other workers
+    TRACE_CHECKPOINT,                                // a shard written to the checkpoint
+    TRACE_TICK,                                      // simulation step of every unit, arg units
+    TRACE_STAGES
+}trace_stage_t;
+
+typedef struct trace_event_struct
+{
+    uint64_t start;                                  // cycles
+    uint32_t duration;                               // cycles, saturates
+    uint8_t  stage;                                  // trace_stage_t
+    uint8_t  unit;                                   // unit id, 0 for none
+    uint16_t arg;
+}trace_event_t;
+
+typedef struct trace_ring_struct
+{
+    uint64_t head;                                   // events ever recorded, the owner writes
+    int      tid;
+    char     name[TRACE_NAME_LENGTH];
+    trace_event_t event[TRACE_EVENTS];
+}__attribute__((aligned(64))) trace_ring_t;
+
+extern __thread trace_ring_t* trace_ring;            // ring of the calling thread, NULL when not traced
+
+int  trace_init(const char* path);
+void trace_attach(const char* name);
+int  trace_dump(void);
+void trace_stop(void);
+
+//
+// Cycle counter, the time stamp counter on x86, the virtual counter on arm64
+// and ns elsewhere. Dumps convert to time with a rate measured against the
+// monotonic clock.
+//
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (cycles));
+    return cycles;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//
+// Start of a stage, 0 when the thread is not traced
+//
+static inline uint64_t trace_begin(void)
+{
+#ifdef NO_TRACE
+    return 0;
+#else
+    return __builtin_expect(trace_ring != NULL, 0) ? trace_clock() : 0;
+#endif
+}
+
+//
+// End of a stage begun with trace_begin, recorded into the thread's ring.
+// The event is complete before head moves past it, a dump reading the ring
+// meanwhile never sees a half written event it would keep.
+//
+static inline void trace_end(uint8_t stage, uint64_t start, uint8_t unit, uint16_t arg)
+{
+    trace_ring_t* ring = trace_ring;
+    trace_event_t* event;
+    uint64_t duration;
+
+    if ( __builtin_expect(start == 0, 1) || ring == NULL )
+    {
+        return;
+    }
+    duration = trace_clock() - start;
+    event = &ring->event[ring->head & (TRACE_EVENTS - 1)];
+    event->start = start;
+    event->duration = ( duration > UINT32_MAX ) ? UINT32_MAX : duration;
+    event->stage = stage;
+    event->unit = unit;
+    event->arg = arg;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -6,17 +6,89 @@
 #define TYPEDEFS_DOT_H
 
 #include <modbus/modbus.h>
+#include "image.h"
 
 typedef enum {false, true} bool;
 
 #define MODBUS_SUCCESS  0
 
+//
+// Battery model state, only ever written by the simulation thread
+//
+typedef struct battery_struct
+{
+    int32_t  power;                              // active set point in kW, negative charges
+    uint16_t heartbeatTimeout;                   // seconds
+    uint32_t heartbeat;                          // simulated ms since the last heartbeat
+    double   state_of_charge;                    // percent, double so ms steps do not round away
+    float    output;                             // kW delivered after limits and ramp, negative charges
+    bool     battery_charging;
+    bool     battery_discharging;
+}battery_t;
+
+#define REPLY_CACHE_ENTRIES     4                // read replies kept per unit, power of 2
+#define REPLY_CACHE_REGISTERS   16               // longest read kept
+
+//
+// FC3 reply payload ready to send, byte count and registers in wire order.
+// Valid while neither the unit has been written nor the simulation ticked.
+//
+typedef struct reply_cache_struct
+{
+    uint16_t address;
+    uint16_t count;                              // 0 when empty
+    uint32_t epoch;                              // reply_epoch of the unit when built
+    uint32_t tick;                               // simulation tick when built
+    uint8_t  data[1 + REPLY_CACHE_REGISTERS * 2];
+}reply_cache_t;
+
+typedef struct unit_struct
+{
+    uint8_t  unit_id;                            // MBAP unit id this battery answers to
+    image_t  image;                              // register image, server thread only
+    uint16_t heartbeat_previous;                 // expected next heartbeat value
+    uint32_t direct_power;                       // set point assembled from directPower registers
+    uint32_t memory;                             // dumpMemory accumulator
+    uint32_t random;                             // fault injection sequence, never 0
+    uint32_t reply_epoch;                        // bumped by every write, server thread only
+    uint32_t reply_next;                         // next reply cache entry to replace
+    reply_cache_t reply[REPLY_CACHE_ENTRIES];    // server thread only
+    battery_t battery;                           // simulation thread only
+    uint32_t sequence;                           // seqlock guarding published
+    uint32_t published_tick;                     // simulation tick published was taken at
+    battery_t published;                         // copy of battery at the last tick boundary
+}unit_t;
+
+typedef enum
+{
+    COMMAND_POWER = 0,                           // value is the new set point in kW
+    COMMAND_TIMEOUT,                             // value is the new heartbeat timeout
+    COMMAND_HEARTBEAT                            // heartbeat received
+}command_type_t;
+
+typedef struct command_struct
+{
+    unit_t*  unit;
+    uint8_t  type;                               // command_type_t
+    int32_t  value;
+}command_t;
+
+typedef int (*process_t)(unit_t*, uint16_t, uint16_t);
+
 typedef struct process_table_struct
 {
 	uint16_t address;
-	int (*handler)(uint16_t, uint16_t);
+	uint16_t size;                                // number of registers
+	process_t read;                               // refresh image before a read, NULL if none
+	process_t write;                              // side effect of a write, NULL if read only
 }process_table_t;
 
+typedef struct dispatch_struct
+{
+    const process_table_t* entry;                // NULL when no handler covers the register
+    uint16_t index;                              // register offset within entry
+}dispatch_t;
+
 
 typedef struct optargs_struct
 {
@@ -28,8 +100,6 @@ typedef struct optargs_struct
 
 typedef struct thread_params_struct
 {
-    modbus_t *ctx;
-	modbus_mapping_t* mb_mapping;
 	pthread_mutex_t mutex;
 	uint8_t *terminate;
 }thread_param_t;
@@ -49,4 +119,20 @@ typedef struct modbus_pdu_struct
 	uint8_t  data[];
 }__attribute__((packed))modbus_pdu_t;
 
+#define CONNECTION_BUFFER_SIZE  (8 * MODBUS_TCP_MAX_ADU_LENGTH)
+#define REPLY_BUFFER_SIZE       (16 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+typedef struct connection_struct
+{
+    struct connection_struct* next;              // free list link while not in use
+    int      fd;                                 // client socket
+    int      length;                             // number of bytes held in query
+    int      reply_length;                       // number of bytes waiting in reply
+    bool     writing;                            // waiting for EPOLLOUT, input paused
+    bool     stepping;                           // simulationStep reply held back, input paused
+    struct deferred_struct* deferred;            // replies held back by fault injection
+    uint8_t  query[CONNECTION_BUFFER_SIZE];      // receive buffer, may hold several frames
+    uint8_t  reply[REPLY_BUFFER_SIZE];           // replies of a batch, sent with one write
+}connection_t;
+
 #endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Hierarchical timing wheel, see wheel.h. Level 0 slots hold the timers of
+ * a single tick, a slot of level n those of 64^n ticks. Whenever level 0
+ * wraps the next slot of level 1 is cascaded into level 0, and so on up.
+ * Runs of empty level 0 slots are skipped with the occupied bitmap, an idle
+ * wheel costs nothing however far time jumps.
+ */
+#include <stdio.h>
+#include "wheel.h"
+
+#define WHEEL_MASK               (WHEEL_SLOTS - 1)
+
+
+static void wheel_link(wheel_timer_t* head, wheel_timer_t* timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void wheel_unlink(wheel_timer_t* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+//
+// Move every timer of a list onto an empty list head
+//
+static void wheel_splice(wheel_timer_t* from, wheel_timer_t* to)
+{
+    if ( from->next == from )
+    {
+        to->next = to->prev = to;
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    from->next = from->prev = from;
+}
+
+//
+// Slot of the level whose slots are just wide enough for the distance to the
+// expiry. Timers already due go into the slot of the next tick, timers beyond
+// the span wait in the last level and are placed again when it cascades.
+//
+static void wheel_place(wheel_t* wheel, wheel_timer_t* timer)
+{
+    uint64_t expires = timer->expires, delta;
+    int level;
+
+    if ( expires < wheel->now )
+    {
+        expires = wheel->now;
+    }
+    delta = expires - wheel->now;
+    if ( delta >= WHEEL_SPAN )
+    {
+        expires = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    for ( level = 0; level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))); level++ )
+    {
+    }
+
+    wheel_link(&wheel->slot[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+    if ( level == 0 )
+    {
+        wheel->occupied |= 1ULL << (expires & WHEEL_MASK);
+    }
+}
+
+static void wheel_cascade(wheel_t* wheel, wheel_timer_t* head)
+{
+    wheel_timer_t list, *timer;
+
+    wheel_splice(head, &list);
+    while ( list.next != &list )
+    {
+        timer = list.next;
+        wheel_unlink(timer);
+        wheel_place(wheel, timer);
+    }
+}
+
+//
+// Run one tick: cascade the upper levels when level 0 wraps, then expire the
+// timers of the tick. Time moves on first, a timer added again from expire
+// goes into a later tick.
+//
+static void wheel_tick(wheel_t* wheel, wheel_expire_t expire)
+{
+    wheel_timer_t list, *timer;
+    int level, index = wheel->now & WHEEL_MASK;
+
+    for ( level = 1; index == 0 && level < WHEEL_LEVELS; level++ )
+    {
+        index = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        wheel_cascade(wheel, &wheel->slot[level][index]);
+    }
+
+    index = wheel->now & WHEEL_MASK;
+    wheel_splice(&wheel->slot[0][index], &list);
+    wheel->occupied &= ~(1ULL << index);
+    wheel->now++;
+
+    while ( list.next != &list )
+    {
+        timer = list.next;
+        wheel_unlink(timer);
+        wheel->count--;
+        expire(timer);
+    }
+}
+
+void wheel_init(wheel_t* wheel, uint64_t now)
+{
+    int level, i;
+
+    wheel->now = now;
+    wheel->count = 0;
+    wheel->occupied = 0;
+    for ( level = 0; level < WHEEL_LEVELS; level++ )
+    {
+        for ( i = 0; i < WHEEL_SLOTS; i++ )
+        {
+            wheel->slot[level][i].next = wheel->slot[level][i].prev = &wheel->slot[level][i];
+        }
+    }
+}
+
+//
+// Move an empty wheel on to now without running the ticks in between, before
+// timers are added to a wheel that may have been idle for long
+//
+void wheel_sync(wheel_t* wheel, uint64_t now)
+{
+    if ( wheel->count == 0 && now > wheel->now )
+    {
+        wheel->now = now;
+        wheel->occupied = 0;
+    }
+}
+
+void wheel_add(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires)
+{
+    timer->expires = expires;
+    wheel_place(wheel, timer);
+    wheel->count++;
+}
+
+//
+// Take a timer off the wheel before it fires, nothing happens if it is not on
+//
+void wheel_del(wheel_t* wheel, wheel_timer_t* timer)
+{
+    if ( timer->next != NULL )
+    {
+        wheel_unlink(timer);
+        wheel->count--;
+    }
+}
+
+//
+// Run every tick up to and including now, expire is called for each timer
+// that fires
+//
+void wheel_advance(wheel_t* wheel, uint64_t now, wheel_expire_t expire)
+{
+    uint64_t pending, skip;
+    int index;
+
+    while ( wheel->now <= now )
+    {
+        if ( wheel->count == 0 )
+        {
+            wheel->now = now + 1;
+            break;
+        }
+        index = wheel->now & WHEEL_MASK;
+        if ( index != 0 )
+        {
+            pending = wheel->occupied >> index;
+            skip = pending ? (uint64_t)__builtin_ctzll(pending) : (uint64_t)(WHEEL_SLOTS - index);
+            if ( skip != 0 )
+            {
+                wheel->now += ( skip < now + 1 - wheel->now ) ? skip : now + 1 - wheel->now;
+                continue;
+            }
+        }
+        wheel_tick(wheel, expire);
+    }
+}
+
+//
+// Ticks until the wheel next needs to run, -1 when it is empty. May be early,
+// never late.
+//
+int wheel_timeout(const wheel_t* wheel, uint64_t now)
+{
+    uint64_t pending, next;
+    int index;
+
+    if ( wheel->count == 0 )
+    {
+        return -1;
+    }
+    index = wheel->now & WHEEL_MASK;
+    pending = wheel->occupied >> index;
+    next = pending ? wheel->now + __builtin_ctzll(pending) : (wheel->now | WHEEL_MASK) + 1;
+    if ( index == 0 && !(pending & 1) )
+    {
+        next = wheel->now;                               // cascade due
+    }
+
+    return ( next > now ) ? (int)(next - now) : 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright © kiwipower 2017
+ *
+ * Hierarchical timing wheel. Four levels of 64 slots cover 64^4 ticks, a
+ * timer goes into the level whose slots are just wide enough for its
+ * distance and is cascaded down a level each time the level below wraps.
+ * Adding and removing a timer are O(1), so are the ticks, however many
+ * timers are pending. Timers are intrusive, the owner embeds a wheel_timer_t.
+ * A wheel belongs to one thread.
+ */
+#ifndef WHEEL_DOT_H
+#define WHEEL_DOT_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS               6
+#define WHEEL_SLOTS              (1 << WHEEL_BITS)   // per level
+#define WHEEL_LEVELS             4                   // 16.7M ticks, 4.6 hours of ms
+#define WHEEL_SPAN               (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct wheel_timer_struct
+{
+    struct wheel_timer_struct* next;                 // NULL while not on the wheel
+    struct wheel_timer_struct* prev;
+    uint64_t expires;                                // tick it fires at
+}wheel_timer_t;
+
+typedef struct wheel_struct
+{
+    uint64_t now;                                    // next tick to run
+    uint32_t count;                                  // timers on the wheel
+    uint64_t occupied;                               // level 0 slots that may hold timers
+    wheel_timer_t slot[WHEEL_LEVELS][WHEEL_SLOTS];   // list heads
+}wheel_t;
+
+typedef void (*wheel_expire_t)(wheel_timer_t* timer);
+
+void wheel_init(wheel_t* wheel, uint64_t now);
+void wheel_sync(wheel_t* wheel, uint64_t now);
+void wheel_add(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires);
+void wheel_del(wheel_t* wheel, wheel_timer_t* timer);
+void wheel_advance(wheel_t* wheel, uint64_t now, wheel_expire_t expire);
+int  wheel_timeout(const wheel_t* wheel, uint64_t now);
+
+#endif